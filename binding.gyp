@@ -4,8 +4,16 @@
       "target_name": "khovratovich",
       "sources": [
         "lib/khovratovich/addon.cc",
+        "lib/khovratovich/cache.cc",
         "lib/khovratovich/pow.cc",
-        "lib/khovratovich/blake/blake2b.cpp"
+        "lib/khovratovich/cpu.cc",
+        "lib/khovratovich/numa.cc",
+        "lib/khovratovich/pool.cc",
+        "lib/khovratovich/search.cc",
+        "lib/khovratovich/scheduler.cc",
+        "lib/khovratovich/verify.cc",
+        "lib/khovratovich/blake/blake2b.cpp",
+        "lib/khovratovich/blake/blake2b-multi.cpp"
       ],
       "include_dirs": ["<!(node -e \"require('nan')\")"],
       "cflags": [
@@ -14,8 +22,31 @@
         #"-mavx",
         "-Wno-maybe-uninitialized",
         "-msse2",
-        "-std=c++11"
-      ]
+        "-std=c++11",
+        "-pthread"
+      ],
+      "ldflags": ["-pthread"]
+    },
+    {
+      "target_name": "radix",
+      "sources": [
+        "lib/radix/addon.cc",
+        "lib/radix/radix.cc",
+        "lib/khovratovich/pow.cc",
+        "lib/khovratovich/cpu.cc",
+        "lib/khovratovich/numa.cc",
+        "lib/khovratovich/scheduler.cc",
+        "lib/khovratovich/blake/blake2b.cpp",
+        "lib/khovratovich/blake/blake2b-multi.cpp"
+      ],
+      "include_dirs": ["<!(node -e \"require('nan')\")"],
+      "cflags": [
+        "-Wno-maybe-uninitialized",
+        "-msse2",
+        "-std=c++11",
+        "-pthread"
+      ],
+      "ldflags": ["-pthread"]
     }
   ]
 }
@@ -7,8 +7,16 @@
  ********************************************************************/
 
 #include <nan.h>
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <memory>
 //#include "addon.h"   // NOLINT(build/include)
 #include "pow.h"  // NOLINT(build/include)
+#include "cache.h"  // NOLINT(build/include)
+#include "pool.h"  // NOLINT(build/include)
+#include "search.h"  // NOLINT(build/include)
+#include "verify.h"  // NOLINT(build/include)
 
 using Nan::AsyncQueueWorker;
 using Nan::AsyncWorker;
@@ -29,21 +37,47 @@ using v8::Object;
 using v8::String;
 using v8::Value;
 
+// stop requests of the solves not yet called back, by the id solve returns;
+// only used on the main thread
+static std::map<uint32_t, std::shared_ptr<SolveCancel>> solveCancels;
+static uint32_t nextSolveId = 0;
+
+// libuv joins its threads when the process exits, so solves still running
+// are stopped rather than left to search on
+static void AbortSolvesAtExit() {
+  for (std::map<uint32_t, std::shared_ptr<SolveCancel>>::iterator it =
+       solveCancels.begin(); it != solveCancels.end(); ++it) {
+    it->second->Abort();
+  }
+}
+
 class EquihashSolutionWorker : public AsyncWorker {
  public:
-  EquihashSolutionWorker(const unsigned n, const unsigned k, Seed seed, Callback *callback)
-    : AsyncWorker(callback), n(n), k(k), seed(seed) {}
-  ~EquihashSolutionWorker() {}
+  EquihashSolutionWorker(const unsigned n, const unsigned k, Seed seed, SolverOptions options,
+    uint32_t id, std::shared_ptr<SolveCancel> cancel, Callback *callback)
+    : AsyncWorker(callback), n(n), k(k), seed(seed), options(options), id(id), cancel(cancel) {
+    this->options.cancel = cancel.get();
+  }
+  ~EquihashSolutionWorker() {
+    solveCancels.erase(id);
+  }
 
   // Executed inside the worker-thread.
   // It is not safe to access V8, or V8 data structures
   // here, so everything we need for input and output
   // should go on `this`.
   void Execute () {
-    Equihash equihash(n, k, seed);
-    Proof p = equihash.FindProof();
-    solution = p.inputs;
-    nonce = p.nonce;
+    proofs = SearchProofs(n, k, seed, options, drops, memory, stats);
+    if (proofs.size() < options.maxSolutions && cancel->Reason() != STOP_NONE) {
+      SetErrorMessage(cancel->Reason() == STOP_ABORTED ? "aborted" : "timeout");
+      return;
+    }
+    if (proofs.empty()) {
+      nonce = MAX_NONCE;
+      return;
+    }
+    solution = proofs[0].inputs;
+    nonce = proofs[0].nonce;
     //printhex("solution", &solution[0], solution.size());
   }
 
@@ -64,6 +98,42 @@ class EquihashSolutionWorker : public AsyncWorker {
      obj->Set(New("nonce").ToLocalChecked(), New(nonce));
      obj->Set(New("value").ToLocalChecked(), proofValue);
 
+     Local<Object> dropped = Nan::New<Object>();
+     dropped->Set(New("tuples").ToLocalChecked(), New<Number>((double)drops.tuples));
+     dropped->Set(New("capped").ToLocalChecked(), New<Number>((double)drops.capped));
+     obj->Set(New("dropped").ToLocalChecked(), dropped);
+
+     Local<Object> backing = Nan::New<Object>();
+     backing->Set(New("backing").ToLocalChecked(),
+       New(BackingName(memory.backing)).ToLocalChecked());
+     backing->Set(New("locked").ToLocalChecked(), New(memory.locked));
+     backing->Set(New("bound").ToLocalChecked(), New(memory.bound));
+     obj->Set(New("memory").ToLocalChecked(), backing);
+
+     if (options.stats) {
+       obj->Set(New("stats").ToLocalChecked(), StatsObject());
+     }
+
+     // every proof found, packed one after the other
+     if (options.maxSolutions > 1) {
+       std::vector<Input> packed;
+       Local<v8::Array> nonces = Nan::New<v8::Array>(proofs.size());
+       Local<v8::Array> offsets = Nan::New<v8::Array>(proofs.size() + 1);
+       for (unsigned i = 0; i < proofs.size(); ++i) {
+         Nan::Set(nonces, i, New(proofs[i].nonce));
+         Nan::Set(offsets, i, New((uint32_t)(packed.size() * 4)));
+         packed.insert(packed.end(), proofs[i].inputs.begin(), proofs[i].inputs.end());
+       }
+       Nan::Set(offsets, proofs.size(), New((uint32_t)(packed.size() * 4)));
+       Local<Object> solutions = Nan::New<Object>();
+       solutions->Set(New("nonces").ToLocalChecked(), nonces);
+       solutions->Set(New("value").ToLocalChecked(),
+         Nan::CopyBuffer((const char*)packed.data(), packed.size() * 4)
+           .ToLocalChecked());
+       solutions->Set(New("offsets").ToLocalChecked(), offsets);
+       obj->Set(New("solutions").ToLocalChecked(), solutions);
+     }
+
      Local<Value> argv[] = {
         Null(),
         obj
@@ -73,11 +143,62 @@ class EquihashSolutionWorker : public AsyncWorker {
   }
 
   private:
+  // phase time in milliseconds and cycles
+  static Local<Object> PhaseObject(uint64_t ns, uint64_t cycles) {
+    Local<Object> phase = Nan::New<Object>();
+    phase->Set(New("time").ToLocalChecked(), New<Number>(ns / 1e6));
+    phase->Set(New("cycles").ToLocalChecked(), New<Number>((double)cycles));
+    return phase;
+  }
+
+  Local<Object> StatsObject() const {
+    Local<Object> result = Nan::New<Object>();
+    result->Set(New("nonces").ToLocalChecked(), New<Number>((double)stats.nonces));
+    result->Set(New("fill").ToLocalChecked(),
+      PhaseObject(stats.fillNs, stats.fillCycles));
+    Local<v8::Array> rounds = Nan::New<v8::Array>(k);
+    for (unsigned i = 0; i < k; ++i) {
+      Nan::Set(rounds, i, PhaseObject(stats.roundNs[i], stats.roundCycles[i]));
+    }
+    result->Set(New("rounds").ToLocalChecked(), rounds);
+    Local<Object> dropped = Nan::New<Object>();
+    dropped->Set(New("tuples").ToLocalChecked(), New<Number>((double)drops.tuples));
+    dropped->Set(New("capped").ToLocalChecked(), New<Number>((double)drops.capped));
+    result->Set(New("dropped").ToLocalChecked(), dropped);
+    result->Set(New("duplicates").ToLocalChecked(), New<Number>((double)stats.duplicates));
+    result->Set(New("peakBytes").ToLocalChecked(), New<Number>((double)stats.peakBytes));
+    return result;
+  }
+
   unsigned n;
   unsigned k;
   Nonce nonce;
   Seed seed;
+  SolverOptions options;
+  uint32_t id;
+  std::shared_ptr<SolveCancel> cancel;
   std::vector<Input> solution;
+  std::vector<Proof> proofs;
+  DropCounts drops;
+  TableMemory memory;
+  SolveStats stats;
+};
+
+class EquihashWarmupWorker : public AsyncWorker {
+ public:
+  EquihashWarmupWorker(const unsigned n, const unsigned k, const unsigned count, Callback *callback)
+    : AsyncWorker(callback), n(n), k(k), count(count) {}
+  ~EquihashWarmupWorker() {}
+
+  // Allocates and prefaults pooled solvers inside the worker-thread
+  void Execute () {
+    SolverPool::Warm(n, k, count);
+  }
+
+  private:
+  unsigned n;
+  unsigned k;
+  unsigned count;
 };
 
 NAN_METHOD(Solve) {
@@ -97,9 +218,42 @@ NAN_METHOD(Solve) {
    Handle<Value> nValue = object->Get(New("n").ToLocalChecked());
    Handle<Value> kValue = object->Get(New("k").ToLocalChecked());
    Handle<Value> seedValue = object->Get(New("seed").ToLocalChecked());
+   Handle<Value> threadsValue = object->Get(New("threads").ToLocalChecked());
+   Handle<Value> parallelNoncesValue =
+     object->Get(New("parallelNonces").ToLocalChecked());
+   Handle<Value> firstWinsValue = object->Get(New("firstWins").ToLocalChecked());
+   Handle<Value> memoryLimitValue =
+     object->Get(New("memoryLimit").ToLocalChecked());
+   Handle<Value> spillValue = object->Get(New("spill").ToLocalChecked());
+   Handle<Value> truncateBitsValue =
+     object->Get(New("truncateBits").ToLocalChecked());
+   Handle<Value> maxSolutionsValue =
+     object->Get(New("maxSolutions").ToLocalChecked());
+   Handle<Value> hugePagesValue =
+     object->Get(New("hugePages").ToLocalChecked());
+   Handle<Value> lockMemoryValue =
+     object->Get(New("lockMemory").ToLocalChecked());
+   Handle<Value> numaValue = object->Get(New("numa").ToLocalChecked());
+   Handle<Value> statsValue = object->Get(New("stats").ToLocalChecked());
+   Handle<Value> deadlineValue =
+     object->Get(New("deadlineMs").ToLocalChecked());
 
    const unsigned n = To<uint32_t>(nValue).FromJust();
    const unsigned k = To<uint32_t>(kValue).FromJust();
+   SolverOptions options;
+   options.threads = std::max(To<uint32_t>(threadsValue).FromJust(), 1U);
+   options.parallelNonces =
+     std::max(To<uint32_t>(parallelNoncesValue).FromJust(), 1U);
+   options.firstWins = To<bool>(firstWinsValue).FromJust();
+   options.memoryLimit = (size_t)To<double>(memoryLimitValue).FromJust();
+   options.spill = To<bool>(spillValue).FromJust();
+   options.truncateBits = To<uint32_t>(truncateBitsValue).FromJust();
+   options.maxSolutions =
+     std::max(To<uint32_t>(maxSolutionsValue).FromJust(), 1U);
+   options.hugePages = To<bool>(hugePagesValue).FromJust();
+   options.lockMemory = To<bool>(lockMemoryValue).FromJust();
+   options.numa = To<bool>(numaValue).FromJust();
+   options.stats = To<bool>(statsValue).FromJust();
    size_t bufferLength = node::Buffer::Length(seedValue) / 4;
    unsigned* seedBuffer = (unsigned*)node::Buffer::Data(seedValue);
 
@@ -107,18 +261,92 @@ NAN_METHOD(Solve) {
 
    Seed seed(seedBuffer, bufferLength);
 
-   AsyncQueueWorker(new EquihashSolutionWorker(n, k, seed, callback));
+   // the deadline counts from the call, so time spent queued counts too
+   std::shared_ptr<SolveCancel> cancel(new SolveCancel);
+   const double deadline = To<double>(deadlineValue).FromJust();
+   if (deadline > 0) {
+     cancel->SetDeadline((uint64_t)deadline);
+   }
+   const uint32_t id = nextSolveId++;
+   solveCancels[id] = cancel;
+
+   AsyncQueueWorker(new EquihashSolutionWorker(n, k, seed, options, id, cancel, callback));
+   info.GetReturnValue().Set(New(id));
 }
 
-NAN_METHOD(Verify) {
+NAN_METHOD(Abort) {
+   const uint32_t id = To<uint32_t>(info[0]).FromJust();
+   std::map<uint32_t, std::shared_ptr<SolveCancel>>::iterator it = solveCancels.find(id);
+   if (it != solveCancels.end()) {
+     it->second->Abort();
+   }
+}
+
+NAN_METHOD(Warmup) {
    // ensure first argument is an object
    if(!info[0]->IsObject()) {
       Nan::ThrowTypeError("'options' must be an object");
       return;
    }
+   // ensure second argument is a callback
+   if(!info[1]->IsFunction()) {
+      Nan::ThrowTypeError("'callback' must be a function");
+      return;
+   }
 
-   // unbundle all data needed to check the proof
+   Callback *callback = new Callback(info[1].As<Function>());
    Handle<Object> object = Handle<Object>::Cast(info[0]);
+   Handle<Value> nValue = object->Get(New("n").ToLocalChecked());
+   Handle<Value> kValue = object->Get(New("k").ToLocalChecked());
+   Handle<Value> countValue = object->Get(New("count").ToLocalChecked());
+
+   const unsigned n = To<uint32_t>(nValue).FromJust();
+   const unsigned k = To<uint32_t>(kValue).FromJust();
+   const unsigned count = To<uint32_t>(countValue).FromJust();
+
+   AsyncQueueWorker(new EquihashWarmupWorker(n, k, count, callback));
+}
+
+NAN_METHOD(ReleaseSolvers) {
+   // the bytes the idle solvers held, freed on this thread
+   info.GetReturnValue().Set(New<Number>((double)SolverPool::Trim()));
+}
+
+// checks a proof, through the verification cache when it is enabled
+static bool TestProof(const Proof& p) {
+  return VerifyCache::Test(p.n, p.k, p.seed, p.nonce, p.inputs.data(),
+    p.inputs.size());
+}
+
+class EquihashVerifyWorker : public AsyncWorker {
+ public:
+  EquihashVerifyWorker(const Proof& proof, Callback *callback)
+    : AsyncWorker(callback), proof(proof), valid(false) {}
+  ~EquihashVerifyWorker() {}
+
+  // Hashes the inputs of the proof inside the worker-thread
+  void Execute () {
+    valid = TestProof(proof);
+  }
+
+  void HandleOKCallback () {
+     HandleScope scope;
+
+     Local<Value> argv[] = {
+        Null(),
+        New(valid)
+     };
+
+     callback->Call(2, argv);
+  }
+
+  private:
+  Proof proof;
+  bool valid;
+};
+
+// unbundle all data needed to check a proof
+static Proof UnpackProof(Handle<Object> object) {
    Handle<Value> nValue = object->Get(New("n").ToLocalChecked());
    Handle<Value> kValue = object->Get(New("k").ToLocalChecked());
    Handle<Value> nonceValue = object->Get(New("nonce").ToLocalChecked());
@@ -141,17 +369,150 @@ NAN_METHOD(Verify) {
    std::vector<Input> inputs;
    inputs.resize(inputBufferLength,0);
    std::copy(inputBuffer, inputBuffer + inputBufferLength, inputs.begin());
-   Proof p(n, k, seed, nonce, inputs);
+   return Proof(n, k, seed, nonce, inputs);
+}
+
+NAN_METHOD(Verify) {
+   // ensure first argument is an object
+   if(!info[0]->IsObject()) {
+      Nan::ThrowTypeError("'options' must be an object");
+      return;
+   }
+
+   Proof p = UnpackProof(Handle<Object>::Cast(info[0]));
 
    // check the proof
-   info.GetReturnValue().Set(p.Test());
+   info.GetReturnValue().Set(TestProof(p));
+}
+
+NAN_METHOD(VerifyAsync) {
+   // ensure first argument is an object
+   if(!info[0]->IsObject()) {
+      Nan::ThrowTypeError("'options' must be an object");
+      return;
+   }
+   // ensure second argument is a callback
+   if(!info[1]->IsFunction()) {
+      Nan::ThrowTypeError("'callback' must be a function");
+      return;
+   }
+
+   // the seed and inputs are copied, so the buffers may change meanwhile
+   Callback *callback = new Callback(info[1].As<Function>());
+   Proof p = UnpackProof(Handle<Object>::Cast(info[0]));
+
+   AsyncQueueWorker(new EquihashVerifyWorker(p, callback));
+}
+
+NAN_METHOD(VerifyBatch) {
+   // ensure first argument is an object
+   if(!info[0]->IsObject()) {
+      Nan::ThrowTypeError("'proofs' must be an object");
+      return;
+   }
+
+   // packed seeds, nonces and values, the same number of words per proof
+   Handle<Object> object = Handle<Object>::Cast(info[0]);
+   Handle<Value> nValue = object->Get(New("n").ToLocalChecked());
+   Handle<Value> kValue = object->Get(New("k").ToLocalChecked());
+   Handle<Value> seedsValue = object->Get(New("seeds").ToLocalChecked());
+   Handle<Value> noncesValue = object->Get(New("nonces").ToLocalChecked());
+   Handle<Value> valuesValue = object->Get(New("values").ToLocalChecked());
+   Handle<Value> threadsValue = object->Get(New("threads").ToLocalChecked());
+   if(!node::Buffer::HasInstance(seedsValue) ||
+      !node::Buffer::HasInstance(noncesValue) ||
+      !node::Buffer::HasInstance(valuesValue)) {
+      Nan::ThrowTypeError("'seeds', 'nonces' and 'values' must be Buffers");
+      return;
+   }
+
+   const unsigned n = To<uint32_t>(nValue).FromJust();
+   const unsigned k = To<uint32_t>(kValue).FromJust();
+   const unsigned threads = std::max(To<uint32_t>(threadsValue).FromJust(), 1U);
+   const size_t count = node::Buffer::Length(noncesValue) / 4;
+   const size_t seedWords = node::Buffer::Length(seedsValue) / 4;
+   const size_t valueWords = node::Buffer::Length(valuesValue) / 4;
+   if(count == 0 || seedWords % count != 0 || valueWords % count != 0) {
+      Nan::ThrowRangeError("every proof must have a seed, a nonce and a value of the same length");
+      return;
+   }
+
+   std::vector<uint8_t> results((count + 7) / 8);
+   VerifyProofs(n, k, count,
+     (const uint32_t*)node::Buffer::Data(seedsValue), seedWords / count,
+     (const Nonce*)node::Buffer::Data(noncesValue),
+     (const Input*)node::Buffer::Data(valuesValue), valueWords / count,
+     threads, results.data());
+
+   info.GetReturnValue().Set(
+     Nan::CopyBuffer((const char*)results.data(), results.size())
+       .ToLocalChecked());
+}
+
+NAN_METHOD(ConfigureVerifyCache) {
+   // ensure first argument is an object
+   if(!info[0]->IsObject()) {
+      Nan::ThrowTypeError("'options' must be an object");
+      return;
+   }
+
+   Handle<Object> object = Handle<Object>::Cast(info[0]);
+   Handle<Value> sizeValue = object->Get(New("size").ToLocalChecked());
+   Handle<Value> ttlValue = object->Get(New("ttl").ToLocalChecked());
+
+   VerifyCache::Configure((size_t)To<double>(sizeValue).FromJust(),
+     (uint64_t)To<double>(ttlValue).FromJust());
+}
+
+NAN_METHOD(VerifyCacheStatistics) {
+   const VerifyCacheStats stats = VerifyCache::Stats();
+
+   Local<Object> obj = Nan::New<Object>();
+   obj->Set(New("hits").ToLocalChecked(), New<Number>((double)stats.hits));
+   obj->Set(New("misses").ToLocalChecked(), New<Number>((double)stats.misses));
+   obj->Set(New("size").ToLocalChecked(), New<Number>((double)stats.entries));
+   info.GetReturnValue().Set(obj);
+}
+
+// [{n, k}] of the parameter sets with solver and verifier kernels compiled
+// for their shape
+static Local<v8::Array> Presets() {
+   Local<v8::Array> presets = Nan::New<v8::Array>();
+   unsigned count = 0;
+#define ADD_PRESET(N, K) { \
+     Local<Object> preset = Nan::New<Object>(); \
+     preset->Set(New("n").ToLocalChecked(), New(N)); \
+     preset->Set(New("k").ToLocalChecked(), New(K)); \
+     presets->Set(count++, preset); \
+   }
+   EQUIHASH_PRESETS(ADD_PRESET)
+#undef ADD_PRESET
+   return presets;
 }
 
 NAN_MODULE_INIT(InitAll) {
+  std::atexit(AbortSolvesAtExit);
   Set(target, New<String>("solve").ToLocalChecked(),
     GetFunction(New<FunctionTemplate>(Solve)).ToLocalChecked());
+  Set(target, New<String>("abort").ToLocalChecked(),
+    GetFunction(New<FunctionTemplate>(Abort)).ToLocalChecked());
   Set(target, New<String>("verify").ToLocalChecked(),
     GetFunction(New<FunctionTemplate>(Verify)).ToLocalChecked());
+  Set(target, New<String>("verifyAsync").ToLocalChecked(),
+    GetFunction(New<FunctionTemplate>(VerifyAsync)).ToLocalChecked());
+  Set(target, New<String>("verifyBatch").ToLocalChecked(),
+    GetFunction(New<FunctionTemplate>(VerifyBatch)).ToLocalChecked());
+  Set(target, New<String>("configureVerifyCache").ToLocalChecked(),
+    GetFunction(New<FunctionTemplate>(ConfigureVerifyCache)).ToLocalChecked());
+  Set(target, New<String>("verifyCacheStats").ToLocalChecked(),
+    GetFunction(New<FunctionTemplate>(VerifyCacheStatistics)).ToLocalChecked());
+  Set(target, New<String>("warmup").ToLocalChecked(),
+    GetFunction(New<FunctionTemplate>(Warmup)).ToLocalChecked());
+  Set(target, New<String>("releaseSolvers").ToLocalChecked(),
+    GetFunction(New<FunctionTemplate>(ReleaseSolvers)).ToLocalChecked());
+  Set(target, New<String>("isa").ToLocalChecked(),
+    New<String>(IsaName(DetectedIsa())).ToLocalChecked());
+  Set(target, New<String>("presets").ToLocalChecked(), Presets());
 }
 
 NODE_MODULE(addon, InitAll)
@@ -13,5 +13,7 @@
 
 NAN_METHOD(Solve);
 NAN_METHOD(Verify);
+NAN_METHOD(Warmup);
+NAN_METHOD(ReleaseSolvers);
 
 #endif  // EQUIHASH_KHOVRATOVICH_ADDON_H_
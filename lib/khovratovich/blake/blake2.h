@@ -144,6 +144,21 @@ extern "C" {
   int blake2sp( uint8_t *out, const void *in, const void *key, const uint8_t outlen, const uint64_t inlen, uint8_t keylen );
   int blake2bp( uint8_t *out, const void *in, const void *key, const uint8_t outlen, const uint64_t inlen, uint8_t keylen );
 
+  // Multi-buffer API for 72-byte messages that share their first 64 bytes,
+  // hashed several at a time to 32-byte digests stored back to back. init
+  // takes the 64-byte prefix; every message then only supplies its last 8
+  // bytes (little-endian word m8).
+  size_t blake2b_multi_lanes( void ); // messages hashed per call to the widest kernel
+  typedef struct __blake2b_72_state
+  {
+    uint64_t v[16];  // working state after the parts of round 0 without m8
+    uint64_t m[8];   // prefix words
+    uint64_t h[4];   // chaining value of the digest words
+  } blake2b_72_state;
+
+  void blake2b_72_init( blake2b_72_state *S, const void *prefix );
+  void blake2b_72( const blake2b_72_state *S, uint8_t *out, const uint64_t *tails, size_t count );
+
   static inline int blake2( uint8_t *out, const void *in, const void *key, const uint8_t outlen, const uint64_t inlen, uint8_t keylen )
   {
     return blake2b( out, in, key, outlen, inlen, keylen );
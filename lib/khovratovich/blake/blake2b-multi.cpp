@@ -0,0 +1,237 @@
+/*
+   Multi-buffer BLAKE2b for the Equihash input: hashes a batch of 72-byte
+   messages with one message per SIMD lane (2-way SSE2, 4-way AVX2, 8-way
+   AVX-512). The width is picked at run time from what the CPU supports.
+
+   The messages only differ in their last 8 bytes (message word m8) and are
+   hashed to 32 bytes. Everything that does not depend on m8 is computed
+   once in blake2b_72_init: with m9..m15 zero, all of round 0 except G4 is
+   the same for every message.
+
+   To the extent possible under law, the author(s) have dedicated all copyright
+   and related and neighboring rights to this software to the public domain
+   worldwide. This software is distributed without any warranty.
+
+   You should have received a copy of the CC0 Public Domain Dedication along with
+   this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "blake2.h"
+#include "blake2-impl.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLAKE2B_MULTI_LANES
+#endif
+
+#if defined(BLAKE2B_MULTI_LANES)
+
+static const uint8_t blake2b_multi_sigma[12][16] =
+{
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 } ,
+  { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 } ,
+  { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 } ,
+  {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 } ,
+  {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 } ,
+  {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 } ,
+  { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 } ,
+  { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 } ,
+  {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 } ,
+  { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13 , 0 } ,
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 } ,
+  { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+typedef uint64_t blake2b_x2 __attribute__ ((vector_size(16)));
+typedef uint64_t blake2b_x4 __attribute__ ((vector_size(32)));
+typedef uint64_t blake2b_x8 __attribute__ ((vector_size(64)));
+
+#define BLAKE2B_MULTI_INLINE inline __attribute__ ((always_inline))
+
+#define ROTR(w,c) ( ( (w) >> (c) ) | ( (w) << ( 64 - (c) ) ) )
+
+#define G(r,i,a,b,c,d)                                   \
+  do {                                                   \
+    a = a + b + m[blake2b_multi_sigma[r][2*i+0]];        \
+    d = ROTR(d ^ a, 32);                   \
+    c = c + d;                                           \
+    b = ROTR(b ^ c, 24);                   \
+    a = a + b + m[blake2b_multi_sigma[r][2*i+1]];        \
+    d = ROTR(d ^ a, 16);                   \
+    c = c + d;                                           \
+    b = ROTR(b ^ c, 63);                   \
+  } while(0)
+
+#define BROADCAST(x) ( V() + (x) )
+
+#define ROUND(r)                                         \
+  do {                                                   \
+    G( r, 0, v[ 0], v[ 4], v[ 8], v[12] );               \
+    G( r, 1, v[ 1], v[ 5], v[ 9], v[13] );               \
+    G( r, 2, v[ 2], v[ 6], v[10], v[14] );               \
+    G( r, 3, v[ 3], v[ 7], v[11], v[15] );               \
+    G( r, 4, v[ 0], v[ 5], v[10], v[15] );               \
+    G( r, 5, v[ 1], v[ 6], v[11], v[12] );               \
+    G( r, 6, v[ 2], v[ 7], v[ 8], v[13] );               \
+    G( r, 7, v[ 3], v[ 4], v[ 9], v[14] );               \
+  } while(0)
+
+/* Finishes L messages from the state left by blake2b_72_init; lane j takes
+   m8 = tails[j]. Message words other than m0..m8 are zero, so the unrolled
+   rounds let the compiler drop their additions. */
+template<typename V, unsigned L>
+static BLAKE2B_MULTI_INLINE void blake2b_72_hash( const blake2b_72_state *S, uint8_t *out, const uint64_t *tails )
+{
+  V v[16], m[16];
+  for( unsigned i = 0; i < 16; ++i )
+    v[i] = BROADCAST( S->v[i] );
+  for( unsigned i = 0; i < 8; ++i )
+    m[i] = BROADCAST( S->m[i] );
+  for( unsigned j = 0; j < L; ++j )
+    m[8][j] = tails[j];
+  for( unsigned i = 9; i < 16; ++i )
+    m[i] = V();
+
+  G( 0, 4, v[ 0], v[ 5], v[10], v[15] );
+  ROUND( 1 );
+  ROUND( 2 );
+  ROUND( 3 );
+  ROUND( 4 );
+  ROUND( 5 );
+  ROUND( 6 );
+  ROUND( 7 );
+  ROUND( 8 );
+  ROUND( 9 );
+  ROUND( 10 );
+  ROUND( 11 );
+
+  V h[4];
+  for( unsigned i = 0; i < 4; ++i )
+    h[i] = BROADCAST( S->h[i] ) ^ v[i] ^ v[i + 8];
+  for( unsigned j = 0; j < L; ++j )
+    for( unsigned i = 0; i < 4; ++i )
+      store64( out + j * 32 + i * sizeof( uint64_t ), h[i][j] );
+}
+
+#undef ROUND
+#undef BROADCAST
+#undef G
+#undef ROTR
+
+static void blake2b_72_x2( const blake2b_72_state *S, uint8_t *out, const uint64_t *tails )
+{
+  blake2b_72_hash<blake2b_x2, 2>( S, out, tails );
+}
+
+__attribute__ ((target("avx2")))
+static void blake2b_72_x4( const blake2b_72_state *S, uint8_t *out, const uint64_t *tails )
+{
+  blake2b_72_hash<blake2b_x4, 4>( S, out, tails );
+}
+
+__attribute__ ((target("avx512f")))
+static void blake2b_72_x8( const blake2b_72_state *S, uint8_t *out, const uint64_t *tails )
+{
+  blake2b_72_hash<blake2b_x8, 8>( S, out, tails );
+}
+
+static unsigned blake2b_multi_detect( void )
+{
+  __builtin_cpu_init();
+  if( __builtin_cpu_supports( "avx512f" ) ) return 8;
+  if( __builtin_cpu_supports( "avx2" ) ) return 4;
+  return 2;
+}
+
+#endif
+
+size_t blake2b_multi_lanes( void )
+{
+#if defined(BLAKE2B_MULTI_LANES)
+  static const unsigned lanes = blake2b_multi_detect();
+  return lanes;
+#else
+  return 1;
+#endif
+}
+
+#define G(i,a,b,c,d,x,y)                                 \
+  do {                                                   \
+    a = a + b + (x);                                     \
+    d = rotr64(d ^ a, 32);                               \
+    c = c + d;                                           \
+    b = rotr64(b ^ c, 24);                               \
+    a = a + b + (y);                                     \
+    d = rotr64(d ^ a, 16);                               \
+    c = c + d;                                           \
+    b = rotr64(b ^ c, 63);                               \
+  } while(0)
+
+void blake2b_72_init( blake2b_72_state *S, const void *prefix )
+{
+  static const uint64_t IV[8] =
+  {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+    0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+  };
+  const uint8_t *p = ( const uint8_t * )prefix;
+  uint64_t *v = S->v;
+  const uint64_t *m = S->m;
+
+  for( unsigned i = 0; i < 8; ++i )
+    S->m[i] = load64( p + i * sizeof( uint64_t ) );
+  for( unsigned i = 0; i < 4; ++i )
+    S->h[i] = IV[i];
+  S->h[0] ^= 0x01010000ULL ^ 32;  // 32-byte digest, no key, sequential
+  for( unsigned i = 0; i < 8; ++i )
+    v[i] = IV[i];
+  v[0] = S->h[0];
+  for( unsigned i = 0; i < 8; ++i )
+    v[i + 8] = IV[i];
+  v[12] ^= 72;                    // byte counter
+  v[14] = ~v[14];                 // last block
+
+  // round 0 without G4, the only step that reads m8
+  G( 0, v[ 0], v[ 4], v[ 8], v[12], m[0], m[1] );
+  G( 1, v[ 1], v[ 5], v[ 9], v[13], m[2], m[3] );
+  G( 2, v[ 2], v[ 6], v[10], v[14], m[4], m[5] );
+  G( 3, v[ 3], v[ 7], v[11], v[15], m[6], m[7] );
+  G( 5, v[ 1], v[ 6], v[11], v[12], 0, 0 );
+  G( 6, v[ 2], v[ 7], v[ 8], v[13], 0, 0 );
+  G( 7, v[ 3], v[ 4], v[ 9], v[14], 0, 0 );
+}
+
+#undef G
+
+void blake2b_72( const blake2b_72_state *S, uint8_t *out, const uint64_t *tails, size_t count )
+{
+#if defined(BLAKE2B_MULTI_LANES)
+  const size_t lanes = blake2b_multi_lanes();
+  for( ; lanes >= 8 && count >= 8; count -= 8, tails += 8, out += 8 * 32 )
+    blake2b_72_x8( S, out, tails );
+  for( ; lanes >= 4 && count >= 4; count -= 4, tails += 4, out += 4 * 32 )
+    blake2b_72_x4( S, out, tails );
+  for( ; count >= 2; count -= 2, tails += 2, out += 2 * 32 )
+    blake2b_72_x2( S, out, tails );
+  if( count == 1 )
+  {
+    uint64_t pair[2] = { tails[0], tails[0] };
+    uint8_t digests[2 * 32];
+    blake2b_72_x2( S, digests, pair );
+    memcpy( out, digests, 32 );
+  }
+#else
+  uint8_t message[72];
+  for( unsigned i = 0; i < 8; ++i )
+    store64( message + i * sizeof( uint64_t ), S->m[i] );
+  for( ; count > 0; --count, ++tails, out += 32 )
+  {
+    store64( message + 64, *tails );
+    blake2b( out, message, NULL, 32, sizeof( message ), 0 );
+  }
+#endif
+}
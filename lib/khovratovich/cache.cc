@@ -0,0 +1,119 @@
+/* Cache of recent verification results. */
+
+#include "cache.h"
+#include "blake/blake2.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+struct Digest {
+    uint8_t bytes[CACHE_DIGEST_BYTES];
+    bool operator==(const Digest& other) const {
+        return memcmp(bytes, other.bytes, CACHE_DIGEST_BYTES) == 0;
+    }
+};
+
+struct DigestHash {
+    size_t operator()(const Digest& digest) const {
+        size_t h;
+        memcpy(&h, digest.bytes, sizeof(h));
+        return h;
+    }
+};
+
+struct Entry {
+    Digest digest;
+    bool valid;
+    std::chrono::steady_clock::time_point added;
+};
+
+typedef std::list<Entry> Entries;  //most recently used first
+
+struct CacheState {
+    std::mutex mutex;
+    std::atomic<bool> enabled;  //capacity above zero, read without the lock
+    size_t capacity;
+    std::chrono::milliseconds ttl;
+    Entries entries;
+    std::unordered_map<Digest, Entries::iterator, DigestHash> index;
+    uint64_t hits;
+    uint64_t misses;
+    CacheState() : enabled(false), capacity(0), ttl(0), hits(0), misses(0) {};
+};
+
+static CacheState& State() {
+    static CacheState* state = new CacheState; //outlives verifications still running at exit
+    return *state;
+}
+
+static Digest ProofDigest(unsigned n, unsigned k, const Seed& seed, Nonce nonce,
+                          const Input* inputs, size_t count) {
+    uint32_t header[3 + SEED_LENGTH] = {n, k, nonce};
+    for (unsigned i = 0; i < SEED_LENGTH; ++i)
+        header[3 + i] = seed[i];
+    blake2b_state state;
+    blake2b_init(&state, CACHE_DIGEST_BYTES);
+    blake2b_update(&state, (const uint8_t*)header, sizeof(header));
+    blake2b_update(&state, (const uint8_t*)inputs, count * sizeof(Input));
+    Digest digest;
+    blake2b_final(&state, digest.bytes, CACHE_DIGEST_BYTES);
+    return digest;
+}
+
+void VerifyCache::Configure(size_t capacity, uint64_t ttlMs) {
+    CacheState& state = State();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.capacity = capacity;
+    state.enabled = capacity != 0;
+    state.ttl = std::chrono::milliseconds(ttlMs);
+    state.entries.clear();
+    state.index.clear();
+    state.hits = 0;
+    state.misses = 0;
+}
+
+bool VerifyCache::Test(unsigned n, unsigned k, const Seed& seed, Nonce nonce,
+                       const Input* inputs, size_t count) {
+    CacheState& state = State();
+    if (!state.enabled)
+        return TestInputs(n, k, seed, nonce, inputs, count);
+    const Digest digest = ProofDigest(n, k, seed, nonce, inputs, count);
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        auto found = state.index.find(digest);
+        if (found != state.index.end()) {
+            Entries::iterator entry = found->second;
+            if (state.ttl.count() == 0 ||
+                std::chrono::steady_clock::now() - entry->added < state.ttl) {
+                state.entries.splice(state.entries.begin(), state.entries, entry);
+                state.hits++;
+                return entry->valid;
+            }
+            state.index.erase(found);
+            state.entries.erase(entry);
+        }
+        state.misses++;
+    }
+
+    const bool valid = TestInputs(n, k, seed, nonce, inputs, count);
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if (state.capacity == 0 || state.index.count(digest) != 0)
+        return valid;
+    state.entries.push_front(Entry{digest, valid, std::chrono::steady_clock::now()});
+    state.index[digest] = state.entries.begin();
+    while (state.entries.size() > state.capacity) {
+        state.index.erase(state.entries.back().digest);
+        state.entries.pop_back();
+    }
+    return valid;
+}
+
+VerifyCacheStats VerifyCache::Stats() {
+    CacheState& state = State();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    return VerifyCacheStats{state.hits, state.misses, state.entries.size()};
+}
@@ -0,0 +1,36 @@
+/* Cache of recent verification results.
+
+   Proofs are often submitted more than once, and each check hashes 2^k
+   inputs. When enabled, results are kept by a BLAKE2b digest of the whole
+   proof (n, k, seed, nonce and inputs), the least recently used entry is
+   evicted once the cache is full, and entries older than the TTL are checked
+   again. The lock is not held while a proof is hashed.
+*/
+
+#ifndef __VERIFY_CACHE
+#define __VERIFY_CACHE
+
+#include "pow.h"
+
+#include <cstddef>
+
+const unsigned CACHE_DIGEST_BYTES = 16; //Proof digest length, collisions must be infeasible
+
+struct VerifyCacheStats{
+      uint64_t hits;
+      uint64_t misses;
+      size_t entries;
+};
+
+class VerifyCache {
+public:
+      //capacity 0 disables the cache; ttlMs 0 keeps entries until evicted;
+      //clears entries and counters
+      static void Configure(size_t capacity, uint64_t ttlMs);
+      //TestInputs, answered from the cache when the proof was seen recently
+      static bool Test(unsigned n, unsigned k, const Seed& seed, Nonce nonce,
+                       const Input* inputs, size_t count);
+      static VerifyCacheStats Stats();
+};
+
+#endif //define __VERIFY_CACHE
@@ -0,0 +1,30 @@
+/* Instruction set selection for the hot kernels. */
+
+#include "cpu.h"
+#include "blake/blake2.h"
+
+static CpuIsa Detect() {
+    switch (blake2b_multi_lanes()) {
+    case 8: return ISA_AVX512;
+    case 4: return ISA_AVX2;
+    case 2: return ISA_SSE2;
+    default: return ISA_GENERIC;
+    }
+}
+
+//The BLAKE2b kernels detect the CPU on first use; make that happen when the
+//module is loaded rather than inside the first solve
+static const CpuIsa detected = Detect();
+
+CpuIsa DetectedIsa() {
+    return detected;
+}
+
+const char* IsaName(CpuIsa isa) {
+    switch (isa) {
+    case ISA_AVX512: return "avx512f";
+    case ISA_AVX2: return "avx2";
+    case ISA_SSE2: return "sse2";
+    default: return "generic";
+    }
+}
@@ -0,0 +1,24 @@
+/* Instruction set selection for the hot kernels.
+
+   The addon is built once for baseline x86-64 (-msse2) and picks wider
+   kernels at run time. The BLAKE2b lane kernels choose their width from
+   CPUID, and the fill and collision loops are compiled for AVX-512, AVX2
+   and the baseline with one selected by the loader (GNU ifunc), both when
+   the module is loaded.
+*/
+
+#ifndef __CPU
+#define __CPU
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define MULTIVERSION __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define MULTIVERSION
+#endif
+
+enum CpuIsa { ISA_GENERIC, ISA_SSE2, ISA_AVX2, ISA_AVX512 };
+
+CpuIsa DetectedIsa();                 //widest instruction set the kernels use
+const char* IsaName(CpuIsa isa);
+
+#endif //define __CPU
@@ -1,10 +1,37 @@
 const addon = require('bindings')('khovratovich');
 
+// instruction set picked for the hashing and collision kernels on this CPU
+exports.isa = addon.isa;
+
+// [{n, k}] solved and verified by kernels compiled for those parameters
+exports.presets = addon.presets;
+
+// error for a solve stopped by its signal ('aborted') or deadline ('timeout')
+const stopError = reason => {
+  const err = reason === 'aborted' ?
+    new Error('Equihash solve was aborted.') :
+    new Error('Equihash solve did not finish before its deadline.');
+  err.name = reason === 'aborted' ? 'AbortError' : 'TimeoutError';
+  return err;
+};
+
 exports.solve = (input, options, callback) => {
   const parameters = {
     n: options.n || 90,
     k: options.k || 5,
-    seed: input
+    seed: input,
+    threads: options.threads || 1,
+    parallelNonces: options.parallelNonces || 1,
+    firstWins: !!options.firstWins,
+    memoryLimit: options.memoryLimit || 0,
+    spill: !!options.spill,
+    truncateBits: options.truncateBits || 0,
+    maxSolutions: options.maxSolutions || 1,
+    hugePages: !!options.hugePages,
+    lockMemory: !!options.lockMemory,
+    numa: !!options.numa,
+    deadlineMs: options.deadlineMs || 0,
+    stats: !!options.stats
   };
 
   if(parameters.k < 1 || parameters.k > 7) {
@@ -14,10 +41,69 @@ exports.solve = (input, options, callback) => {
       new Error('Equihash \'k\' parameter must be between 1 and 7.'));
   }
 
-  addon.solve(parameters, callback);
+  if(parameters.truncateBits < 0 || parameters.truncateBits > 8) {
+    return callback(
+      new Error('Equihash \'truncateBits\' option must be between 0 and 8.'));
+  }
+
+  // collision keys of the rounds with a spill area must fit in 32 bits
+  if(parameters.spill &&
+    Math.floor(parameters.n / (parameters.k + 1)) > 25) {
+    return callback(new Error(
+      'Equihash \'spill\' option requires n/(k+1) to be at most 25.'));
+  }
+
+  const signal = options.signal;
+  if(signal && signal.aborted) {
+    return callback(stopError('aborted'));
+  }
+
+  const onAbort = () => addon.abort(id);
+  const id = addon.solve(parameters, (err, proof) => {
+    if(signal) {
+      signal.removeEventListener('abort', onAbort);
+    }
+    if(err && (err.message === 'aborted' || err.message === 'timeout')) {
+      return callback(stopError(err.message));
+    }
+    callback(err, proof);
+  });
+  if(signal) {
+    signal.addEventListener('abort', onAbort);
+  }
 };
 
-exports.verify = (input, options) => {
+exports.warmup = (options, callback) => {
+  const parameters = {
+    n: options.n || 90,
+    k: options.k || 5,
+    count: options.count || 1
+  };
+
+  if(parameters.k < 1 || parameters.k > 7) {
+    return callback(
+      new Error('Equihash \'k\' parameter must be between 1 and 7.'));
+  }
+
+  addon.warmup(parameters, callback);
+};
+
+// frees the solvers kept warm; returns the bytes they held
+exports.releaseSolvers = () => addon.releaseSolvers();
+
+// keeps up to options.size verification results (0 disables the cache) for
+// options.ttl milliseconds (0 for no limit); clears the cache
+exports.configureVerifyCache = options => {
+  addon.configureVerifyCache({
+    size: options.size || 0,
+    ttl: options.ttl || 0
+  });
+};
+
+exports.verifyCacheStats = () => addon.verifyCacheStats();
+
+// parameters for the addon, or null if the proof is invalid on its face
+const verifyParameters = (input, options) => {
   const parameters = {
     n: options.n || 90,
     k: options.k || 5,
@@ -28,13 +114,54 @@ exports.verify = (input, options) => {
 
   if(parameters.value.length < 128) {
     // solutions less than 128 bytes in length are invalid
-    return false;
+    return null;
   }
 
   if(parameters.k < 1 || parameters.k > 7) {
     // k must be less than 7
-    return false;
+    return null;
+  }
+
+  return parameters;
+};
+
+exports.verify = (input, options) => {
+  const parameters = verifyParameters(input, options);
+  return parameters !== null && addon.verify(parameters);
+};
+
+// verifies on a worker thread; returns a Promise if no callback is given
+exports.verifyAsync = (input, options, callback) => {
+  if(!callback) {
+    return new Promise((resolve, reject) => exports.verifyAsync(
+      input, options, (err, valid) => err ? reject(err) : resolve(valid)));
+  }
+
+  const parameters = verifyParameters(input, options);
+  if(parameters === null) {
+    process.nextTick(() => callback(null, false));
+    return;
+  }
+
+  addon.verifyAsync(parameters, callback);
+};
+
+exports.verifyBatch = proofs => {
+  const parameters = {
+    n: proofs.n || 90,
+    k: proofs.k || 5,
+    seeds: proofs.seeds,
+    nonces: proofs.nonces,
+    values: proofs.values,
+    threads: proofs.threads || 1
+  };
+  const count = parameters.nonces.length / 4;
+
+  if(parameters.values.length < 128 * count ||
+    parameters.k < 1 || parameters.k > 7) {
+    // the same proofs that verify rejects up front
+    return Buffer.alloc(Math.ceil(count / 8));
   }
 
-  return addon.verify(parameters);
+  return addon.verifyBatch(parameters);
 };
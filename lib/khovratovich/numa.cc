@@ -0,0 +1,138 @@
+/* NUMA placement of solver threads and tables. */
+
+#include "numa.h"
+
+#ifdef __linux__
+
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+struct NodeTopology {
+    cpu_set_t startup;                //affinity when the topology was read
+    std::vector<cpu_set_t> cpus;      //usable CPUs of every node
+    std::vector<unsigned> ids;        //kernel id of every node
+    std::vector<int> cpuNode;         //node of every CPU, -1 if not usable
+};
+
+//Parses a sysfs list such as "0-3,8-11" into the ids it names
+static std::vector<unsigned> ReadList(const char* path) {
+    std::vector<unsigned> ids;
+    FILE* f = fopen(path, "r");
+    if (f == nullptr)
+        return ids;
+    unsigned first, last;
+    while (fscanf(f, "%u", &first) == 1) {
+        last = first;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%u", &last) != 1)
+                break;
+            c = fgetc(f);
+        }
+        for (unsigned i = first; i <= last && i < CPU_SETSIZE; ++i)
+            ids.push_back(i);
+        if (c != ',')
+            break;
+    }
+    fclose(f);
+    return ids;
+}
+
+static NodeTopology ReadTopology() {
+    NodeTopology topology;
+    CPU_ZERO(&topology.startup);
+    if (sched_getaffinity(0, sizeof(topology.startup), &topology.startup) != 0)
+        return topology;
+    topology.cpuNode.assign(CPU_SETSIZE, -1);
+    const std::vector<unsigned> online = ReadList("/sys/devices/system/node/online");
+    for (unsigned i = 0; i < online.size() && topology.ids.size() < MAX_NUMA_NODES; ++i) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", online[i]);
+        const std::vector<unsigned> cpus = ReadList(path);
+        cpu_set_t usable;
+        CPU_ZERO(&usable);
+        for (unsigned j = 0; j < cpus.size(); ++j) {
+            if (CPU_ISSET(cpus[j], &topology.startup)) {
+                CPU_SET(cpus[j], &usable);
+                topology.cpuNode[cpus[j]] = (int)topology.ids.size();
+            }
+        }
+        if (CPU_COUNT(&usable) == 0)
+            continue;
+        topology.cpus.push_back(usable);
+        topology.ids.push_back(online[i]);
+    }
+    return topology;
+}
+
+static const NodeTopology& Topology() {
+    static const NodeTopology* topology = new NodeTopology(ReadTopology()); //workers outlive exit
+    return *topology;
+}
+
+unsigned NumaNodes() {
+    const size_t nodes = Topology().ids.size();
+    return nodes == 0 ? 1 : (unsigned)nodes;
+}
+
+unsigned CurrentNode() {
+    const NodeTopology& topology = Topology();
+    const int cpu = sched_getcpu();
+    if (cpu < 0 || (size_t)cpu >= topology.cpuNode.size() || topology.cpuNode[cpu] < 0)
+        return 0;
+    return (unsigned)topology.cpuNode[cpu];
+}
+
+bool PinToNode(unsigned node) {
+    const NodeTopology& topology = Topology();
+    if (topology.ids.size() < 2 || node >= topology.ids.size())
+        return false;
+    return sched_setaffinity(0, sizeof(cpu_set_t), &topology.cpus[node]) == 0;
+}
+
+void Unpin() {
+    const NodeTopology& topology = Topology();
+    if (topology.ids.size() < 2)
+        return;
+    sched_setaffinity(0, sizeof(cpu_set_t), &topology.startup);
+}
+
+//A policy of the range overrides the one of the task, so a node outside the
+//set the task is bound to, as by numactl --membind, is never preferred
+static bool TaskAllows(unsigned id, unsigned long* mask, unsigned long maxNode) {
+    int mode;
+    if (syscall(SYS_get_mempolicy, &mode, mask, maxNode, nullptr, 0UL) != 0)
+        return true;
+    const unsigned bits = 8 * sizeof(unsigned long);
+    return (mode & ~MPOL_MODE_FLAGS) != MPOL_BIND || (mask[id / bits] >> (id % bits) & 1) != 0;
+}
+
+bool BindToNode(void* p, size_t bytes, unsigned node) {
+    const NodeTopology& topology = Topology();
+    if (topology.ids.size() < 2 || node >= topology.ids.size())
+        return false;
+    const unsigned id = topology.ids[node];
+    const unsigned bits = 8 * sizeof(unsigned long);
+    unsigned long mask[1024 / bits] = {};
+    if (id >= 1024 || !TaskAllows(id, mask, 1024))
+        return false;
+    std::fill(mask, mask + 1024 / bits, 0UL);
+    mask[id / bits] = 1UL << (id % bits);
+    return syscall(SYS_mbind, p, bytes, MPOL_PREFERRED, mask, (unsigned long)1024, 0) == 0;
+}
+
+#else
+
+unsigned NumaNodes() { return 1; }
+unsigned CurrentNode() { return 0; }
+bool PinToNode(unsigned) { return false; }
+void Unpin() {}
+bool BindToNode(void*, size_t, unsigned) { return false; }
+
+#endif
@@ -0,0 +1,27 @@
+/* NUMA placement of solver threads and tables.
+
+   The topology is read from sysfs once: the online nodes that have CPUs the
+   process may run on, numbered densely from 0. Threads are pinned with
+   sched_setaffinity and tables are bound with the mbind system call, so the
+   addon does not link libnuma. Nodes are preferred rather than required,
+   and a node outside the nodes of `numactl --membind` is not bound at all,
+   since the policy of a range would override the one of the process. On a
+   single node, or outside Linux, every node is 0 and nothing is pinned.
+*/
+
+#ifndef __NUMA
+#define __NUMA
+
+#include <cstddef>
+
+const unsigned MAX_NUMA_NODES = 64;
+
+unsigned NumaNodes();                 //nodes with usable CPUs, at least 1
+unsigned CurrentNode();               //node of the CPU running the caller
+bool PinToNode(unsigned node);        //run the calling thread on the CPUs of node only
+void Unpin();                         //restore the affinity the process started with
+//Prefers node for the pages of [p, p+bytes) not yet faulted in; p is page aligned.
+//False if the process is bound to other nodes
+bool BindToNode(void* p, size_t bytes, unsigned node);
+
+#endif //define __NUMA
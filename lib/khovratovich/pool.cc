@@ -0,0 +1,85 @@
+/* Pool of Equihash solvers kept warm between solves. */
+
+#include "pool.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <utility>
+
+typedef std::tuple<unsigned, unsigned, unsigned> PoolKey;
+typedef std::vector<std::unique_ptr<Equihash>> IdleSolvers;
+
+static size_t idleBytes = 0; //held by all idle solvers, guarded by PoolMutex
+
+//Never destroyed, like the scheduler: threads may still release solvers
+//while the process exits
+static std::mutex& PoolMutex() {
+    static std::mutex* mutex = new std::mutex;
+    return *mutex;
+}
+
+static std::map<PoolKey, IdleSolvers>& PoolSolvers() {
+    static std::map<PoolKey, IdleSolvers>* solvers = new std::map<PoolKey, IdleSolvers>;
+    return *solvers;
+}
+
+//Bytes an idle solver holds: what its last solve used, or more if its
+//tables kept the capacity of an earlier, larger solve
+static size_t HeldBytes(const Equihash& solver) {
+    return std::max(solver.MemoryFootprint(), solver.TableBytes());
+}
+
+std::unique_ptr<Equihash> SolverPool::Acquire(unsigned n, unsigned k, const Seed& seed, unsigned node) {
+    {
+        std::lock_guard<std::mutex> lock(PoolMutex());
+        IdleSolvers& idle = PoolSolvers()[PoolKey(n, k, node)];
+        if (!idle.empty()) {
+            std::unique_ptr<Equihash> solver = std::move(idle.back());
+            idle.pop_back();
+            idleBytes -= HeldBytes(*solver);
+            solver->SetSeed(seed);
+            return solver;
+        }
+    }
+    std::unique_ptr<Equihash> solver(NewSolver(n, k, seed));
+    solver->SetNode(node);
+    return solver;
+}
+
+void SolverPool::Release(std::unique_ptr<Equihash> solver) {
+    if (!solver)
+        return;
+    const size_t bytes = HeldBytes(*solver);
+    std::lock_guard<std::mutex> lock(PoolMutex());
+    if (bytes > MAX_IDLE_BYTES - idleBytes)
+        return; //does not fit, freed with the lease
+    PoolSolvers()[PoolKey(solver->N(), solver->K(), solver->Node())].push_back(std::move(solver));
+    idleBytes += bytes;
+}
+
+void SolverPool::Warm(unsigned n, unsigned k, unsigned count) {
+    //solvers are warmed with default options, so they are released at this footprint
+    const size_t bytes = std::max(Equihash::MemoryFootprint(n, k, SolverOptions()), (size_t)1);
+    count = (unsigned)std::min((size_t)count, MAX_IDLE_BYTES / bytes);
+    std::vector<std::unique_ptr<Equihash>> warmed;
+    for (unsigned i = 0; i < count; ++i) {
+        warmed.push_back(Acquire(n, k, Seed()));
+        warmed.back()->Prefault();
+    }
+    for (unsigned i = 0; i < warmed.size(); ++i)
+        Release(std::move(warmed[i]));
+}
+
+size_t SolverPool::Trim() {
+    std::map<PoolKey, IdleSolvers> freed;
+    size_t bytes;
+    {
+        std::lock_guard<std::mutex> lock(PoolMutex());
+        freed.swap(PoolSolvers());
+        bytes = idleBytes;
+        idleBytes = 0;
+    }
+    return bytes;
+}
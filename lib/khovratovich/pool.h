@@ -0,0 +1,43 @@
+/* Pool of Equihash solvers kept warm between solves.
+
+   Setting up a solver allocates and page-faults its tables, which is a large
+   part of the cost of a short solve. Idle solvers are kept here keyed by
+   (n,k) and the NUMA node their tables are bound to; a solver is leased to
+   exactly one thread at a time, so every thread that is solving owns a warm
+   context and only resets its fill counters. Idle solvers are capped by the
+   bytes their last solve used, not by count, since one 144/5 solver holds
+   as much as hundreds of 90/5 ones; Trim frees them all.
+*/
+
+#ifndef __POOL
+#define __POOL
+
+#include "pow.h"
+
+#include <memory>
+
+const size_t MAX_IDLE_BYTES = ((size_t)256) << 20; //Over all keys, solvers that do not fit are freed
+
+class SolverPool {
+public:
+      static std::unique_ptr<Equihash> Acquire(unsigned n, unsigned k, const Seed& seed,
+                                               unsigned node = ANY_NODE);
+      static void Release(std::unique_ptr<Equihash> solver);
+      static void Warm(unsigned n, unsigned k, unsigned count); //preallocate and prefault
+      static size_t Trim(); //free every idle solver, returns the bytes they held
+};
+
+/* Solver borrowed from the pool for the lifetime of the lease */
+class SolverLease {
+      std::unique_ptr<Equihash> solver;
+      SolverLease(const SolverLease&);
+      SolverLease& operator=(const SolverLease&);
+public:
+      SolverLease(unsigned n, unsigned k, const Seed& seed, unsigned node = ANY_NODE) :
+          solver(SolverPool::Acquire(n, k, seed, node)) {};
+      ~SolverLease() { SolverPool::Release(std::move(solver)); };
+      Equihash* operator->() { return solver.get(); }
+      Equihash& operator*() { return *solver; }
+};
+
+#endif //define __POOL
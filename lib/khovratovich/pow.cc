@@ -3,10 +3,18 @@ CC0 license
 */
 
 #include "pow.h"
+#include "numa.h"
 #include "blake/blake2.h"
+#include "scheduler.h"
 #include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
-/*
 static uint64_t rdtsc(void) {
 #ifdef _MSC_VER
     return __rdtsc();
@@ -20,190 +28,1214 @@ static uint64_t rdtsc(void) {
     __asm__ __volatile__("rdtsc" : "=A"(rax) : : );
     return rax;
 #else
-#error "Not implemented!"
+    return 0; //no time stamp counter, stats report 0 cycles
 #endif
 #endif
 }
+
+/* Adds the wall time and cycles since the last lap to a phase of
+   SolveStats; does nothing unless stats were asked for
 */
+class PhaseTimer {
+    const bool enabled;
+    std::chrono::steady_clock::time_point time;
+    uint64_t cycles;
+public:
+    explicit PhaseTimer(bool on) : enabled(on), cycles(0) {
+        if (enabled) {
+            time = std::chrono::steady_clock::now();
+            cycles = rdtsc();
+        }
+    }
+    void Lap(uint64_t& ns, uint64_t& phaseCycles) {
+        if (!enabled)
+            return;
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        const uint64_t c = rdtsc();
+        ns += std::chrono::duration_cast<std::chrono::nanoseconds>(now - time).count();
+        phaseCycles += c - cycles;
+        time = now;
+        cycles = c;
+    }
+};
 using namespace std;
 
+static uint32_t* AllocateAligned(size_t words) {
+    void* p = nullptr;
+#ifdef _MSC_VER
+    p = _aligned_malloc(words * sizeof(uint32_t), CACHE_LINE);
+#else
+    if (posix_memalign(&p, CACHE_LINE, words * sizeof(uint32_t)) != 0)
+        p = nullptr;
+#endif
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return (uint32_t*)p;
+}
+
+static void FreeAligned(uint32_t* p) {
+#ifdef _MSC_VER
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+const char* BackingName(MemoryBacking backing) {
+    switch (backing) {
+    case BACKING_HUGETLB: return "hugetlb";
+    case BACKING_TRANSPARENT: return "transparent";
+    default: return "default";
+    }
+}
+
+//Bytes mapped for a table of words: whole huge pages if it may get them,
+//whole small pages otherwise
+static size_t MappedBytes(size_t words, bool huge) {
+#ifdef __linux__
+    const size_t page = huge ? HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE);
+#else
+    const size_t page = HUGE_PAGE;
+#endif
+    return (words * sizeof(uint32_t) + page - 1) / page * page;
+}
+
+#if defined(__linux__) && defined(MAP_HUGETLB) && defined(MADV_HUGEPAGE)
+//Anonymous mapping of bytes aligned to HUGE_PAGE, or nullptr
+static void* MapAligned(size_t bytes) {
+    void* p = mmap(nullptr, bytes + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return nullptr;
+    const uintptr_t start = (uintptr_t)p;
+    const uintptr_t aligned = (start + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+    if (aligned > start)
+        munmap(p, aligned - start);
+    munmap((void*)(aligned + bytes), start + HUGE_PAGE - aligned);
+    return (void*)aligned;
+}
+#endif
+
+void TupleTable::Allocate(size_t words) {
+    //tables of at least a huge page try the reserved pool first, then a
+    //mapping that transparent huge pages may back, then the heap; tables
+    //for a node are always mapped, and bound before a page is faulted in;
+    //locked tables are always mapped too, as mlock does not nest and a heap
+    //block shares its edge pages with other allocations
+    const bool huge = hugeWanted && words * sizeof(uint32_t) >= HUGE_PAGE;
+    const size_t bytes = MappedBytes(words, huge);
+    hugeAsked = hugeWanted;
+    lockAsked = lockWanted;
+    nodeAsked = nodeWanted;
+    backing = BACKING_DEFAULT;
+    locked = false;
+    bound = false;
+#if defined(__linux__) && defined(MAP_HUGETLB) && defined(MADV_HUGEPAGE)
+    if (huge || lockWanted || nodeWanted != ANY_NODE) {
+        void* p = MAP_FAILED;
+        if (huge)
+            p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+            backing = BACKING_HUGETLB;
+        else if ((p = MapAligned(bytes)) != nullptr && huge && madvise(p, bytes, MADV_HUGEPAGE) == 0)
+            backing = BACKING_TRANSPARENT;
+        if (p != nullptr && p != MAP_FAILED) {
+            data = (uint32_t*)p;
+            mapped = bytes;
+            if (nodeWanted != ANY_NODE)
+                bound = BindToNode(p, bytes, nodeWanted);
+        }
+    }
+#endif
+    if (data == nullptr)
+        data = AllocateAligned(words);
+    capacity = words;
+#ifdef __linux__
+    if (lockWanted && mapped != 0)
+        locked = mlock(data, mapped) == 0;
+#endif
+}
+
+void TupleTable::Free() {
+    if (data == nullptr)
+        return;
+#ifdef __linux__
+    if (locked)
+        munlock(data, mapped);
+    if (mapped != 0)
+        munmap(data, mapped);
+    else
+        FreeAligned(data);
+#else
+    FreeAligned(data);
+#endif
+    data = nullptr;
+    capacity = 0;
+    mapped = 0;
+}
+
+TableMemory TupleTable::Memory() const {
+    TableMemory memory;
+    if (data != nullptr) {
+        memory.backing = backing;
+        memory.locked = locked;
+        memory.bound = bound;
+    }
+    return memory;
+}
+
+TupleTable::~TupleTable() {
+    Free();
+}
+
+unsigned TupleTable::RowStride(unsigned blocks, bool narrow) {
+    const unsigned alignWords = (narrow ? NARROW_ROW_ALIGN : CACHE_LINE) / sizeof(uint32_t);
+    const unsigned entryWords = BlockWords(blocks, narrow) + 1; //blocks and reference
+    return (LIST_LENGTH * entryWords + alignWords - 1) / alignWords * alignWords;
+}
+
+void TupleTable::Reset(unsigned rows_in, unsigned blocks_in, bool narrow_in, unsigned spill) {
+    rows = rows_in;
+    blockCount = blocks_in;
+    narrow = narrow_in;
+    wordCount = BlockWords(blockCount, narrow);
+    entryStride = wordCount + 1; //blocks and reference
+    rowStride = RowStride(blockCount, narrow);
+    size_t words = (size_t)rows * rowStride;
+    if (words > capacity || hugeWanted != hugeAsked || lockWanted != lockAsked || nodeWanted != nodeAsked) {
+        const size_t keep = std::max(words, capacity);
+        Free();
+        Allocate(keep);
+    }
+    filled.assign(rows, 0);
+    spillCapacity = spill;
+    spillArea.resize((size_t)spill * entryStride);
+    spillStart.resize(spill > 0 ? rows : 0);
+}
+
+void TupleTable::Swap(TupleTable& r) {
+    std::swap(data, r.data);
+    std::swap(capacity, r.capacity);
+    std::swap(mapped, r.mapped);
+    std::swap(backing, r.backing);
+    std::swap(locked, r.locked);
+    std::swap(hugeAsked, r.hugeAsked);
+    std::swap(lockAsked, r.lockAsked);
+    std::swap(bound, r.bound);
+    std::swap(nodeAsked, r.nodeAsked);
+    filled.swap(r.filled);
+    std::swap(rows, r.rows);
+    std::swap(blockCount, r.blockCount);
+    std::swap(wordCount, r.wordCount);
+    std::swap(narrow, r.narrow);
+    std::swap(entryStride, r.entryStride);
+    std::swap(rowStride, r.rowStride);
+    spillArea.swap(r.spillArea);
+    spillStart.swap(r.spillStart);
+    std::swap(spillCapacity, r.spillCapacity);
+}
+
+void TupleTable::Prefault() {
+    if (data != nullptr)
+        memset(data, 0, capacity * sizeof(uint32_t));
+}
+
+void ForkTable::Reset(unsigned count_in, unsigned bits) {
+    count = count_in;
+    refBits = bits;
+    words.resize(Bytes(count, refBits) / sizeof(uint64_t));
+}
+
+void ForkTable::Clear() {
+    std::fill(words.begin(), words.end(), 0);
+}
+
+void ForkTable::SetShared(unsigned index, Fork fork) {
+    const uint64_t mask = ((uint64_t)1 << refBits) - 1;
+    const uint64_t value = (fork.ref1 & mask) | (fork.ref2 & mask) << refBits;
+    const uint64_t bit = (uint64_t)index * 2 * refBits;
+    const unsigned shift = bit % 64;
+    __atomic_fetch_or(&words[bit / 64], value << shift, __ATOMIC_RELAXED);
+    if (shift + 2 * refBits > 64)
+        __atomic_fetch_or(&words[bit / 64 + 1], value >> (64 - shift), __ATOMIC_RELAXED);
+}
+
+//leaf index bits left out of the forks; at most half a block, so that the
+//block collided in the first round rules out all but about one of the
+//2^(2*truncated) input pairs of a fork
+static unsigned TruncatedBits(unsigned n, unsigned k, const SolverOptions& options)
+{
+    return std::min(std::min(options.truncateBits, MAX_TRUNCATE_BITS), n / (k + 1) / 2);
+}
+
+void Equihash::Prefault()
+{
+    uint32_t  tuple_n = ((uint32_t)1) << (n / (k + 1));
+    tupleList.Reset(tuple_n, k, Narrow(), SpillEntries(tuple_n));
+    collisionList.Reset(tuple_n, k - 1, Narrow(), SpillEntries(tuple_n));
+    tupleList.Prefault();
+    collisionList.Prefault();
+    forks.resize(k - 1);
+    for (unsigned i = 0; i + 1 < k; ++i) {
+        forks[i].Reset(ForkCapacity(tuple_n), ForkBits(i, tuple_n));
+        forks[i].Clear();
+    }
+    forkLevels = 0;
+}
+
+size_t Equihash::TableBytes() const
+{
+    size_t bytes = tupleList.Bytes() + collisionList.Bytes();
+    for (unsigned i = 0; i < forks.size(); ++i)
+        bytes += forks[i].Allocated();
+    return bytes;
+}
+
+TableMemory Equihash::Memory() const
+{
+    TableMemory memory = tupleList.Memory();
+    memory += collisionList.Memory();
+    return memory;
+}
+
+size_t Equihash::MemoryFootprint(unsigned n, unsigned k, const SolverOptions& options)
+{
+    const bool spill = options.spill;
+    const bool narrow = n / (k + 1) <= NARROW_BITS;
+    const size_t rows = ((size_t)1) << (n / (k + 1));
+    const size_t spillEntries = spill ? rows / SPILL_FRACTION + SPILL_LENGTH : 0;
+    size_t bytes = 0;
+    for (unsigned blocks = k - 1; blocks <= k; ++blocks) { //tuple and collision tables
+        //mapped tables take whole pages, see TupleTable::Allocate
+        const size_t words = rows * TupleTable::RowStride(blocks, narrow);
+        const bool huge = options.hugePages && words * sizeof(uint32_t) >= HUGE_PAGE;
+        const bool mapped = huge || options.lockMemory || (options.numa && NumaNodes() > 1);
+        bytes += mapped ? MappedBytes(words, huge) : words * sizeof(uint32_t);
+        bytes += rows * sizeof(uint32_t); //fill counts
+        if (spill)
+            bytes += (spillEntries * (TupleTable::BlockWords(blocks, narrow) + 1) + rows) * sizeof(uint32_t);
+    }
+    const size_t forksPerRound = spill ? rows * LIST_LENGTH + spillEntries : rows * FORK_MULTIPLIER;
+    if (k > 1) { //the last round keeps no forks
+        const unsigned leafBits = n / (k + 1) + 1 - TruncatedBits(n, k, options);
+        const unsigned refBits = 32 - __builtin_clz(forksPerRound - 1);
+        bytes += ForkTable::Bytes(forksPerRound, leafBits) + (k - 2) * ForkTable::Bytes(forksPerRound, refBits);
+    }
+    //scratch of the parallel fill and rounds: entries set aside per chunk,
+    //the few zero collisions of the last round, and the key bitmap and ranks
+    if (options.threads > 1 || spill) {
+        const size_t chunks = (size_t)std::max(options.threads, 1U) * CHUNKS_PER_THREAD;
+        bytes += rows / OVERFLOW_FRACTION * (TupleTable::BlockWords(k, narrow) + 2) * sizeof(uint32_t);
+        bytes += chunks * CACHE_LINE;
+        if (KeysFit(n, k, options)) {
+            const size_t rowSlots = spill ? LIST_LENGTH + SPILL_LENGTH : LIST_LENGTH;
+            const size_t keyWords = (rows * rowSlots * rowSlots + 63) / 64;
+            bytes += keyWords * (sizeof(uint64_t) + sizeof(uint32_t));
+        }
+    }
+    return bytes;
+}
+
+unsigned Equihash::SpillEntries(unsigned rows) const
+{
+    return options.spill ? rows / SPILL_FRACTION + SPILL_LENGTH : 0;
+}
+
+unsigned Equihash::ForkCapacity(unsigned rows) const
+{
+    //with a spill area every kept entry gets a fork
+    if (options.spill)
+        return rows * LIST_LENGTH + SpillEntries(rows);
+    return rows * FORK_MULTIPLIER;
+}
+
+unsigned Equihash::ForkBits(unsigned level, unsigned rows) const
+{
+    //the first round refers to inputs, below 2*rows, the others to forks of
+    //the round before
+    if (level == 0)
+        return n / (k + 1) + 1 - TruncatedBits(n, k, options);
+    return 32 - __builtin_clz(ForkCapacity(rows) - 1);
+}
+
 void Equihash::InitializeMemory()
 {
     uint32_t  tuple_n = ((uint32_t)1) << (n / (k + 1));
-    Tuple default_tuple(k); // k blocks to store (one left for index)
-    std::vector<Tuple> def_tuples(LIST_LENGTH, default_tuple);
-    tupleList = std::vector<std::vector<Tuple>>(tuple_n, def_tuples);
-    filledList= std::vector<unsigned>(tuple_n, 0);
+    tupleList.Reset(tuple_n, k, Narrow(), SpillEntries(tuple_n)); // k blocks to store (one left for index)
     solutions.resize(0);
-    forks.resize(0);
+    forkLevels = 0;
 }
 
 void Equihash::PrintTuples(FILE* fp) {
     unsigned count = 0;
-    for (unsigned i = 0; i < tupleList.size(); ++i) {
-        for (unsigned m = 0; m < filledList[i]; ++m) {
+    for (unsigned i = 0; i < tupleList.Rows(); ++i) {
+        for (unsigned m = 0; m < tupleList.Filled(i); ++m) {
             fprintf(fp, "[%d][%d]:", i,m);
-            for (unsigned j = 0; j < tupleList[i][m].blocks.size(); ++j)
-                fprintf(fp, " %x ", tupleList[i][m].blocks[j]);
-            fprintf(fp, " || %x", tupleList[i][m].reference);
+            for (unsigned j = 0; j < tupleList.Words(); ++j)
+                fprintf(fp, " %x ", tupleList.Entry(i, m)[j]);
+            fprintf(fp, " || %x", tupleList.Reference(i, m));
             fprintf(fp, " |||| ");
         }
-        count += filledList[i];
+        count += tupleList.Filled(i);
         fprintf(fp, "\n");
     }
     fprintf(fp, "TOTAL: %d elements printed", count);
 }
 
-void Equihash::FillMemory(uint32_t length) //works for k<=7
+/* Hashes the inputs of one nonce HASH_BATCH at a time with the fixed-length
+   BLAKE2b kernel: the seed is the shared 64-byte prefix and the nonce and
+   index form the last message word. Next returns the hash of input i,
+   computing the batch that starts at i when i is not in the current batch.
+*/
+class IndexHasher {
+    blake2b_72_state state;
+    uint64_t tails[HASH_BATCH];
+    uint32_t hash[HASH_BATCH][MAX_N / 4];
+    const Nonce nonce;
+    uint32_t first;     //position of the current batch
+    unsigned count;     //hashes in the current batch
+public:
+    IndexHasher(const Seed& seed, Nonce nonce_in) : nonce(nonce_in), first(0), count(0) {
+        uint32_t prefix[SEED_LENGTH];
+        for (unsigned i = 0; i < SEED_LENGTH; ++i)
+            prefix[i] = seed[i];
+        blake2b_72_init(&state, prefix);
+    }
+    //hash of input i of the inputs below end; input i is indices[i], or i
+    //itself when indices is null
+    const uint32_t* Next(const Input* indices, uint32_t i, uint32_t end) {
+        if (i - first >= count) {
+            first = i;
+            count = std::min<uint32_t>(HASH_BATCH, end - i);
+            for (unsigned b = 0; b < count; ++b) {
+                const uint64_t index = indices != nullptr ? indices[i + b] : i + b;
+                tails[b] = nonce | index << 32;   //input words SEED_LENGTH and SEED_LENGTH+1
+            }
+            blake2b_72(&state, (uint8_t*)hash, tails, count);
+        }
+        return hash[i - first];
+    }
+};
+
+//Stores blocks 1..blocks of a hash, each cut to its top 32-shift bits
+template<bool NARROW>
+static inline void StoreBlocks(uint32_t* entry, const uint32_t* buf, unsigned blocks, unsigned shift)
+{
+    if (!NARROW) {
+        for (unsigned j = 1; j < blocks + 1; ++j) {
+            //select j-th block of n/(k+1) bits
+            entry[j - 1] = buf[j] >> shift;
+        }
+        return;
+    }
+    for (unsigned j = 0; 2 * j < blocks; ++j) {
+        const uint32_t high = 2 * j + 1 < blocks ? buf[2 * j + 2] >> shift : 0;
+        entry[j] = buf[2 * j + 1] >> shift | high << 16;
+    }
+}
+
+template<unsigned K, unsigned BITS>
+void Equihash::FillRows(uint32_t length)
 {
-    uint32_t input[SEED_LENGTH + 2];
-    for (unsigned i = 0; i < SEED_LENGTH; ++i)
-        input[i] = seed[i];
-    input[SEED_LENGTH] = nonce;
-    input[SEED_LENGTH + 1] = 0;
-    uint32_t buf[MAX_N / 4];
-    for (unsigned i = 0; i < length; ++i, ++input[SEED_LENGTH + 1]) {
-        blake2b((uint8_t*)buf, &input, NULL, sizeof(buf), sizeof(input), 0);
-        uint32_t index = buf[0] >> (32 - n / (k + 1));
-        unsigned count = filledList[index];
+    const unsigned blocks = K != 0 ? K : k;
+    const unsigned shift = 32 - (K != 0 ? BITS : n / (k + 1));
+    const bool narrow = K != 0 ? BITS <= NARROW_BITS : tupleList.Narrow();
+    const unsigned words = TupleTable::BlockWords(blocks, narrow);
+    IndexHasher hasher(seed, nonce);
+    for (unsigned i = 0; i < length; ++i) {
+        const uint32_t* buf = hasher.Next(nullptr, i, length);
+        uint32_t index = buf[0] >> shift;
+        unsigned& count = tupleList.Filled(index);
         if (count < LIST_LENGTH) {
-            for (unsigned j = 1; j < (k + 1); ++j) {
-                //select j-th block of n/(k+1) bits
-                tupleList[index][count].blocks[j - 1] = buf[j] >> (32 - n / (k + 1));
+            uint32_t* entry = tupleList.Entry(index, count);
+            if (narrow)
+                StoreBlocks<true>(entry, buf, blocks, shift);
+            else
+                StoreBlocks<false>(entry, buf, blocks, shift);
+            entry[words] = i;
+            count++;
+        }
+        else {
+            drops.tuples++;
+        }
+    }
+}
+
+void Equihash::FillMemory(uint32_t length) //works for k<=7
+{
+    if (options.threads > 1 || options.spill)
+        return FillMemoryParallel(length);
+    FillRows(length);
+}
+
+void Equihash::FillRows(uint32_t length)
+{
+    FillRows<0, 0>(length);
+}
+
+void Equihash::FillMemoryParallel(uint32_t length)
+{
+    //Every chunk hashes a contiguous index range and claims row slots with an
+    //atomic counter. Entries that find their row full are set aside and
+    //merged afterwards, so the table ends up exactly as the serial fill
+    //leaves it: the LIST_LENGTH smallest indices of every row, in order.
+    const unsigned chunks = options.threads * CHUNKS_PER_THREAD;
+    if (overflow.size() < chunks)
+        overflow.resize(chunks);
+    Scheduler::Instance().ParallelFor(chunks, options.threads, [&](unsigned chunk) {
+        std::vector<uint32_t>& spill = overflow[chunk];
+        spill.clear();
+        FillRange((uint64_t)length * chunk / chunks, (uint64_t)length * (chunk + 1) / chunks, spill);
+    });
+    MergeOverflow(tupleList, chunks);
+}
+
+template<unsigned K, unsigned BITS>
+void Equihash::FillRange(uint32_t begin, uint32_t end, std::vector<uint32_t>& spill)
+{
+    const unsigned blocks = K != 0 ? K : k;
+    const unsigned shift = 32 - (K != 0 ? BITS : n / (k + 1));
+    const bool narrow = K != 0 ? BITS <= NARROW_BITS : tupleList.Narrow();
+    const unsigned words = TupleTable::BlockWords(blocks, narrow);
+    const unsigned entryWords = words + 1;
+    IndexHasher hasher(seed, nonce);
+    for (uint32_t i = begin; i < end; ++i) {
+        const uint32_t* buf = hasher.Next(nullptr, i, end);
+        uint32_t index = buf[0] >> shift;
+        unsigned slot = AtomicIncrement(tupleList.Filled(index));
+        uint32_t* entry;
+        if (slot < LIST_LENGTH) {
+            entry = tupleList.Entry(index, slot);
+        }
+        else {
+            spill.push_back(index);
+            spill.resize(spill.size() + entryWords);
+            entry = &spill[spill.size() - entryWords];
+        }
+        if (narrow)
+            StoreBlocks<true>(entry, buf, blocks, shift);
+        else
+            StoreBlocks<false>(entry, buf, blocks, shift);
+        entry[words] = i;
+    }
+}
+
+void Equihash::FillRange(uint32_t begin, uint32_t end, std::vector<uint32_t>& spill)
+{
+    FillRange<0, 0>(begin, end, spill);
+}
+
+void Equihash::MergeOverflow(TupleTable& table, unsigned chunks)
+{
+    const unsigned words = table.Words();
+    const unsigned entryWords = words + 1;
+    if (table.SpillCapacity() > 0) {
+        SpillOverflow(table, chunks);
+    }
+    else {
+        for (unsigned c = 0; c < chunks; ++c) {
+            const std::vector<uint32_t>& spill = overflow[c];
+            for (size_t pos = 0; pos < spill.size(); pos += entryWords + 1) {
+                const uint32_t row = spill[pos];
+                const uint32_t* candidate = &spill[pos + 1];
+                unsigned largest = 0;
+                for (unsigned slot = 1; slot < LIST_LENGTH; ++slot) {
+                    if (table.Reference(row, slot) > table.Reference(row, largest))
+                        largest = slot;
+                }
+                if (candidate[words] < table.Reference(row, largest))
+                    std::copy(candidate, candidate + entryWords, table.Entry(row, largest));
+                drops.tuples++; //either the candidate or the entry it replaced
+            }
+        }
+    }
+    //Slots were claimed in any order, sort every row by reference
+    const unsigned rows = table.Rows();
+    const unsigned rowChunks = options.threads * CHUNKS_PER_THREAD;
+    Scheduler::Instance().ParallelFor(rowChunks, options.threads, [&](unsigned chunk) {
+        uint32_t tmp[MAX_N / 4 + 1];
+        const unsigned begin = (uint64_t)rows * chunk / rowChunks;
+        const unsigned end = (uint64_t)rows * (chunk + 1) / rowChunks;
+        for (unsigned row = begin; row < end; ++row) {
+            unsigned& filled = table.Filled(row);
+            if (filled > LIST_LENGTH && table.SpillCapacity() == 0)
+                filled = LIST_LENGTH;
+            //rows that spilled are sorted already, their first slots stay in place
+            const unsigned sorted = std::min<unsigned>(filled, LIST_LENGTH);
+            for (unsigned i = 1; i < sorted; ++i) {
+                unsigned j = i;
+                if (table.Reference(row, j - 1) < table.Reference(row, j))
+                    continue;
+                std::copy(table.Entry(row, i), table.Entry(row, i) + entryWords, tmp);
+                for (; j > 0 && table.Reference(row, j - 1) > tmp[words]; --j)
+                    std::copy(table.Entry(row, j - 1), table.Entry(row, j - 1) + entryWords, table.Entry(row, j));
+                std::copy(tmp, tmp + entryWords, table.Entry(row, j));
             }
-            tupleList[index][count].reference = i;
-            filledList[index]++;
         }
+    });
+}
+
+void Equihash::SpillOverflow(TupleTable& table, unsigned chunks)
+{
+    //Rows are visited in order. Every row that got more than LIST_LENGTH
+    //entries keeps its smallest references in the row and up to SPILL_LENGTH
+    //more in the spill area while it has room, so the table does not depend
+    //on the order in which slots were claimed.
+    const unsigned words = table.Words();
+    const unsigned entryWords = words + 1;
+    std::vector<const uint32_t*> extra; //row followed by the entry
+    for (unsigned c = 0; c < chunks; ++c) {
+        const std::vector<uint32_t>& spill = overflow[c];
+        for (size_t pos = 0; pos < spill.size(); pos += entryWords + 1)
+            extra.push_back(&spill[pos]);
+    }
+    std::sort(extra.begin(), extra.end(), [words](const uint32_t* a, const uint32_t* b) {
+        return a[0] != b[0] ? a[0] < b[0] : a[1 + words] < b[1 + words];
+    });
+    std::vector<uint32_t> merged;
+    std::vector<unsigned> order;
+    unsigned used = 0;
+    for (size_t first = 0, last; first < extra.size(); first = last) {
+        const uint32_t row = extra[first][0];
+        for (last = first; last < extra.size() && extra[last][0] == row; ++last);
+        merged.clear();
+        for (unsigned slot = 0; slot < LIST_LENGTH; ++slot)
+            merged.insert(merged.end(), table.Entry(row, slot), table.Entry(row, slot) + entryWords);
+        for (size_t e = first; e < last; ++e)
+            merged.insert(merged.end(), extra[e] + 1, extra[e] + 1 + entryWords);
+        const unsigned count = merged.size() / entryWords;
+        order.resize(count);
+        for (unsigned e = 0; e < count; ++e)
+            order[e] = e;
+        std::sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+            return merged[a * entryWords + words] < merged[b * entryWords + words];
+        });
+        const unsigned spilled = std::min(std::min(count - LIST_LENGTH, SPILL_LENGTH),
+                                          table.SpillCapacity() - used);
+        for (unsigned e = 0; e < LIST_LENGTH; ++e)
+            std::copy(&merged[order[e] * entryWords], &merged[order[e] * entryWords] + entryWords,
+                      table.Entry(row, e));
+        table.SetSpillStart(row, used);
+        for (unsigned e = 0; e < spilled; ++e)
+            std::copy(&merged[order[LIST_LENGTH + e] * entryWords],
+                      &merged[order[LIST_LENGTH + e] * entryWords] + entryWords, table.SpillEntry(used + e));
+        used += spilled;
+        table.Filled(row) = LIST_LENGTH + spilled;
+        drops.tuples += count - LIST_LENGTH - spilled;
+    }
+}
+
+bool Equihash::MarkInput(Input input) {
+    //open addressing; slots stamped with an older tree count as empty
+    const unsigned bits = __builtin_ctzll(treeSeen.size());
+    const uint64_t mask = treeSeen.size() - 1;
+    for (uint64_t slot = (input * 0x9E3779B97F4A7C15ULL) >> (64 - bits); ; slot = (slot + 1) & mask) {
+        if ((uint32_t)(treeSeen[slot] >> 32) != treeStamp) {
+            treeSeen[slot] = (uint64_t)treeStamp << 32 | input;
+            return true;
+        }
+        if ((uint32_t)treeSeen[slot] == input)
+            return false;
     }
 }
 
-std::vector<Input> Equihash::ResolveTreeByLevel(Fork fork, unsigned level) {
+bool Equihash::ResolveTree(Fork fork, Input* out) {
+    if (TruncatedBits(n, k, options) > 0)
+        return RecoverTree(fork, out);
+    //depth first with the first reference on top, so the inputs come out in
+    //tree order; the walk stops at the first input that repeats
+    const size_t leaves = (size_t)2 << forkLevels;
+    if (treeSeen.size() < 2 * leaves)
+        treeSeen.assign(2 * leaves, 0);
+    if (++treeStamp == 0) {
+        std::fill(treeSeen.begin(), treeSeen.end(), 0);
+        treeStamp = 1;
+    }
+    treeStack.clear();
+    treeStack.push_back(std::make_pair(fork, forkLevels));
+    while (!treeStack.empty()) {
+        const Fork node = treeStack.back().first;
+        const unsigned level = treeStack.back().second;
+        treeStack.pop_back();
+        if (level == 0) {
+            if (!MarkInput(node.ref1) || !MarkInput(node.ref2))
+                return false;
+            *out++ = node.ref1;
+            *out++ = node.ref2;
+            continue;
+        }
+        treeStack.push_back(std::make_pair(forks[level - 1].Get(node.ref2), level - 1));
+        treeStack.push_back(std::make_pair(forks[level - 1].Get(node.ref1), level - 1));
+    }
+    return true;
+}
+
+void Equihash::AddSolution(Fork fork) {
+    treeInputs.resize((size_t)2 << forkLevels);
+    if (ResolveTree(fork, &treeInputs[0]))
+        solutions.push_back(Proof(n, k, seed, nonce, treeInputs));
+    else
+        stats.duplicates++;
+}
+
+/* Recovers the inputs of a candidate whose leaf references kept only their
+   low bits. Every leaf is one of 2^truncated inputs, found by hashing them
+   all; a fork keeps the combinations of its two subtrees that collide on the
+   block of its round, which leaves about one per fork.
+*/
+class TreeRecovery {
+public:
+    struct Subtree {
+        std::vector<Input> inputs;
+        std::vector<uint32_t> blocks;  //XOR of the blocks of the inputs
+    };
+    TreeRecovery(const std::vector<ForkTable>& forks_in, const Seed& seed_in, Nonce nonce_in,
+                 unsigned n_in, unsigned k_in, unsigned truncated_in) :
+        forks(forks_in), seed(seed_in), nonce(nonce_in), n(n_in), k(k_in), truncated(truncated_in) {};
+    std::vector<Subtree> Resolve(Fork fork, unsigned level);
+    bool RepeatsFork(Fork fork, unsigned level);
+private:
+    const std::vector<ForkTable>& forks;
+    const Seed& seed;
+    const Nonce nonce;
+    const unsigned n;
+    const unsigned k;
+    const unsigned truncated;
+    std::vector<Subtree> Leaves(Input low);
+    void CollectForks(Fork fork, unsigned level, std::vector<uint64_t>& ids);
+};
+
+void TreeRecovery::CollectForks(Fork fork, unsigned level, std::vector<uint64_t>& ids) {
     if (level == 0)
-        return std::vector<Input>{fork.ref1, fork.ref2};
-    auto v1 = ResolveTreeByLevel(forks[level - 1][fork.ref1], level - 1);
-    auto v2 = ResolveTreeByLevel(forks[level - 1][fork.ref2], level - 1);
-    v1.insert(v1.end(), v2.begin(), v2.end());
-    return v1;
+        return;
+    ids.push_back((uint64_t)level << 32 | fork.ref1);
+    ids.push_back((uint64_t)level << 32 | fork.ref2);
+    CollectForks(forks[level - 1].Get(fork.ref1), level - 1, ids);
+    CollectForks(forks[level - 1].Get(fork.ref2), level - 1, ids);
 }
 
-std::vector<Input> Equihash::ResolveTree(Fork fork) {
-    return ResolveTreeByLevel(fork, forks.size());
+//true if a fork occurs twice in the tree, so that its inputs do too; most
+//candidates are such trivial ones and are ruled out before any hashing
+bool TreeRecovery::RepeatsFork(Fork fork, unsigned level) {
+    std::vector<uint64_t> ids;
+    CollectForks(fork, level, ids);
+    std::sort(ids.begin(), ids.end());
+    return std::adjacent_find(ids.begin(), ids.end()) != ids.end();
 }
 
+std::vector<TreeRecovery::Subtree> TreeRecovery::Leaves(Input low) {
+    const unsigned bits = n / (k + 1);
+    const unsigned kept = bits + 1 - truncated;
+    std::vector<Input> inputs(1U << truncated);
+    for (unsigned high = 0; high < inputs.size(); ++high)
+        inputs[high] = (low & ((1U << kept) - 1)) | high << kept;
+    IndexHasher hasher(seed, nonce);
+    std::vector<Subtree> leaves(inputs.size());
+    for (unsigned i = 0; i < inputs.size(); ++i) {
+        const uint32_t* buf = hasher.Next(&inputs[0], i, inputs.size());
+        leaves[i].inputs.push_back(inputs[i]);
+        for (unsigned j = 0; j < (k + 1); ++j)
+            leaves[i].blocks.push_back(buf[j] >> (32 - bits));
+    }
+    return leaves;
+}
+
+std::vector<TreeRecovery::Subtree> TreeRecovery::Resolve(Fork fork, unsigned level) {
+    std::vector<Subtree> left = level == 0 ? Leaves(fork.ref1) : Resolve(forks[level - 1].Get(fork.ref1), level - 1);
+    std::vector<Subtree> right = level == 0 ? Leaves(fork.ref2) : Resolve(forks[level - 1].Get(fork.ref2), level - 1);
+    auto byBlock = [level](const Subtree& a, const Subtree& b) { return a.blocks[level] < b.blocks[level]; };
+    std::sort(right.begin(), right.end(), byBlock);
+    std::vector<Subtree> joined;
+    for (unsigned a = 0; a < left.size(); ++a) {
+        auto range = std::equal_range(right.begin(), right.end(), left[a], byBlock);
+        for (auto b = range.first; b != range.second; ++b) {
+            //rows are filled in input order, so a first-round fork refers
+            //to the lower input first
+            if (level == 0 && left[a].inputs[0] >= b->inputs[0])
+                continue;
+            //subtrees that share an input collide on every block; they only
+            //make solutions that repeat inputs, which are rejected anyway
+            bool shared = false;
+            for (unsigned i = 0; i < b->inputs.size() && !shared; ++i)
+                shared = std::find(left[a].inputs.begin(), left[a].inputs.end(), b->inputs[i]) != left[a].inputs.end();
+            if (shared)
+                continue;
+            Subtree s = left[a];
+            s.inputs.insert(s.inputs.end(), b->inputs.begin(), b->inputs.end());
+            for (unsigned j = 0; j < (k + 1); ++j)
+                s.blocks[j] ^= b->blocks[j];
+            joined.push_back(s);
+        }
+    }
+    return joined;
+}
+
+bool Equihash::RecoverTree(Fork fork, Input* out) {
+    TreeRecovery recovery(forks, seed, nonce, n, k, TruncatedBits(n, k, options));
+    if (recovery.RepeatsFork(fork, forkLevels))
+        return false;
+    std::vector<TreeRecovery::Subtree> found = recovery.Resolve(fork, forkLevels);
+    for (unsigned i = 0; i < found.size(); ++i) {
+        if (std::count(found[i].blocks.begin(), found[i].blocks.end(), 0U) == (int)(k + 1)) {
+            std::copy(found[i].inputs.begin(), found[i].inputs.end(), out);
+            return true;
+        }
+    }
+    return false; //every recovered tree repeats an input
+}
+
+
+/* A pair of entries whose forks share a child holds that child twice, so
+   it can only lead to solutions that repeat inputs. Truncated input
+   references can be equal for different inputs, so the forks are only
+   compared once they refer to other forks.
+*/
+inline bool Equihash::SharesChild(const uint32_t* first, const uint32_t* second) const {
+    const unsigned words = tupleList.Words();
+    if (forkLevels == 0 || (forkLevels == 1 && TruncatedBits(n, k, options) > 0))
+        return false;
+    const Fork a = forks[forkLevels - 1].Get(first[words]);
+    const Fork b = forks[forkLevels - 1].Get(second[words]);
+    return a.ref1 == b.ref1 || a.ref1 == b.ref2 || a.ref2 == b.ref1 || a.ref2 == b.ref2;
+}
 
 void Equihash::ResolveCollisions(bool store) {
-    const unsigned tableLength = tupleList.size();  //number of rows in the hashtable
-    const unsigned maxNewCollisions = tupleList.size()*FORK_MULTIPLIER;  //max number of collisions to be found
-    const unsigned newBlocks = tupleList[0][0].blocks.size() - 1;// number of blocks in the future collisions
-    std::vector<Fork> newForks(maxNewCollisions); //list of forks created at this step
-    auto tableRow = vector<Tuple>(LIST_LENGTH, Tuple(newBlocks)); //Row in the hash table
-    vector<vector<Tuple>> collisionList(tableLength,tableRow);
-    std::vector<unsigned> newFilledList(tableLength,0);  //number of entries in rows
+    const unsigned tableLength = tupleList.Rows();  //number of rows in the hashtable
+    const unsigned maxNewCollisions = ForkCapacity(tableLength);  //max number of collisions to be found
+    const unsigned oldBlocks = tupleList.Blocks();
+    const unsigned newBlocks = oldBlocks - 1;// number of blocks in the future collisions
+    if (forks.size() <= forkLevels)
+        forks.push_back(ForkTable());
+    ForkTable& newForks = forks[forkLevels]; //list of forks created at this step
+    if (!store) { //the last round keeps no forks
+        newForks.Reset(maxNewCollisions, ForkBits(forkLevels, tableLength));
+        collisionList.Reset(tableLength, newBlocks, tupleList.Narrow(), SpillEntries(tableLength));
+    }
+    if ((options.threads > 1 || options.spill) && KeysFit(n, k, options)) {
+        ResolveCollisionsParallel(store);
+        forkLevels++;
+        if (!store)
+            tupleList.Swap(collisionList);
+        return;
+    }
+    ResolveRows(store);
+    forkLevels++;
+    if (!store)
+        tupleList.Swap(collisionList);
+}
+
+//Row of the next table: the first block of the xor of two entries
+template<bool NARROW>
+static inline uint32_t NewRow(const uint32_t* first, const uint32_t* second)
+{
+    return NARROW ? (first[0] ^ second[0]) & 0xFFFF : first[0] ^ second[0];
+}
+
+//Stores the other blocks of the xor of two entries
+template<bool NARROW>
+static inline void XorBlocks(uint32_t* entry, const uint32_t* first, const uint32_t* second,
+                             unsigned oldWords, unsigned newWords)
+{
+    if (!NARROW) {
+        for (unsigned l = 0; l < newWords; ++l)
+            entry[l] = first[l+1] ^ second[l+1];
+        return;
+    }
+    //every block moves down by half a word
+    for (unsigned l = 0; l < newWords; ++l) {
+        const uint32_t next = l + 1 < oldWords ? first[l+1] ^ second[l+1] : 0;
+        entry[l] = (first[l] ^ second[l]) >> 16 | next << 16;
+    }
+}
+
+template<unsigned OLD_BLOCKS, bool NARROW>
+void Equihash::ResolveRows(bool store) {
+    const unsigned tableLength = tupleList.Rows();
+    const unsigned maxNewCollisions = ForkCapacity(tableLength);
+    const unsigned oldBlocks = OLD_BLOCKS != 0 ? OLD_BLOCKS : tupleList.Blocks();
+    const unsigned oldWords = TupleTable::BlockWords(oldBlocks, NARROW);
+    const unsigned newWords = TupleTable::BlockWords(oldBlocks - 1, NARROW);
+    ForkTable& newForks = forks[forkLevels];
     uint32_t newColls = 0; //collision counter
     for (unsigned i = 0; i < tableLength; ++i) {
-        for (unsigned j = 0; j < filledList[i]; ++j)        {
-            for (unsigned m = j + 1; m < filledList[i]; ++m) {   //Collision
+        const unsigned filled = tupleList.Filled(i);
+        for (unsigned j = 0; j < filled; ++j)        {
+            const uint32_t* first = tupleList.Entry(i, j);
+            for (unsigned m = j + 1; m < filled; ++m) {   //Collision
+                const uint32_t* second = tupleList.Entry(i, m);
                 //New index
-                uint32_t newIndex = tupleList[i][j].blocks[0] ^ tupleList[i][m].blocks[0];
-                Fork newFork = Fork(tupleList[i][j].reference, tupleList[i][m].reference);
+                uint32_t newIndex = NewRow<NARROW>(first, second);
+                Fork newFork = Fork(first[oldWords], second[oldWords]);
                 //Check if we get a solution
                 if (store) {  //last step
-                    if (newIndex == 0) {//Solution
-                        std::vector<Input> solution_inputs = ResolveTree(newFork);
-                        solutions.push_back(Proof(n, k, seed, nonce, solution_inputs));
-                    }
+                    if (newIndex == 0 && SharesChild(first, second))
+                        stats.duplicates++;
+                    else if (newIndex == 0) //Solution
+                        AddSolution(newFork);
                 }
                 else {         //Resolve
-                    if (newFilledList[newIndex] < LIST_LENGTH && newColls < maxNewCollisions) {
-                        for (unsigned l = 0; l < newBlocks; ++l) {
-                            collisionList[newIndex][newFilledList[newIndex]].blocks[l]
-                                = tupleList[i][j].blocks[l+1] ^ tupleList[i][m].blocks[l+1];
-                        }
-                        newForks[newColls] = newFork;
-                        collisionList[newIndex][newFilledList[newIndex]].reference = newColls;
-                        newFilledList[newIndex]++;
+                    unsigned& newFilled = collisionList.Filled(newIndex);
+                    if (newFilled < LIST_LENGTH && newColls < maxNewCollisions) {
+                        uint32_t* entry = collisionList.Entry(newIndex, newFilled);
+                        XorBlocks<NARROW>(entry, first, second, oldWords, newWords);
+                        newForks.Set(newColls, newFork);
+                        entry[newWords] = newColls;
+                        newFilled++;
                         newColls++;
                     }//end of adding collision
+                    else if (newFilled >= LIST_LENGTH)
+                        drops.tuples++;
+                    else
+                        drops.capped++;
                 }
             }
         }//end of collision for i
     }
-    forks.push_back(newForks);
-    std::swap(tupleList, collisionList);
-    std::swap(filledList, newFilledList);
+}
+
+void Equihash::ResolveRows(bool store)
+{
+    if (tupleList.Narrow())
+        ResolveRows<0, true>(store);
+    else
+        ResolveRows<0, false>(store);
+}
+
+void Equihash::ResolveCollisionsParallel(bool store) {
+    //Source rows are split into contiguous chunks. Every collision gets a key
+    //that follows the serial generation order; new rows keep their
+    //LIST_LENGTH smallest keys and fork ids are the ranks of the kept keys,
+    //so the round matches the serial one for any thread count.
+    const unsigned tableLength = tupleList.Rows();
+    const unsigned maxNewCollisions = ForkCapacity(tableLength);
+    const unsigned rowSlots = RowSlots();
+    const unsigned pairSlots = rowSlots * rowSlots; //keys per source row
+    const unsigned chunks = options.threads * CHUNKS_PER_THREAD;
+    Scheduler& scheduler = Scheduler::Instance();
+    if (overflow.size() < chunks)
+        overflow.resize(chunks);
+    if (candidates.size() < chunks)
+        candidates.resize(chunks);
+    scheduler.ParallelFor(chunks, options.threads, [&](unsigned chunk) {
+        std::vector<uint32_t>& spill = overflow[chunk];
+        std::vector<Fork>& found = candidates[chunk];
+        spill.clear();
+        found.clear();
+        CollideRows((uint64_t)tableLength * chunk / chunks, (uint64_t)tableLength * (chunk + 1) / chunks,
+                    store, spill, found);
+    });
+    if (store) {
+        for (unsigned c = 0; c < chunks; ++c) {
+            for (unsigned f = 0; f < candidates[c].size(); ++f)
+                AddSolution(candidates[c][f]);
+        }
+        return;
+    }
+    MergeOverflow(collisionList, chunks);
+
+    //Rank the kept keys to hand out fork ids in generation order
+    const size_t keyWords = ((size_t)tableLength * pairSlots + 63) / 64;
+    keyBits.assign(keyWords, 0);
+    keyRanks.resize(keyWords);
+    scheduler.ParallelFor(chunks, options.threads, [&](unsigned chunk) {
+        const unsigned begin = (uint64_t)tableLength * chunk / chunks;
+        const unsigned end = (uint64_t)tableLength * (chunk + 1) / chunks;
+        for (unsigned row = begin; row < end; ++row) {
+            for (unsigned slot = 0; slot < collisionList.Filled(row); ++slot) {
+                uint32_t key = collisionList.Reference(row, slot);
+                __atomic_fetch_or(&keyBits[key / 64], (uint64_t)1 << (key % 64), __ATOMIC_RELAXED);
+            }
+        }
+    });
+    std::vector<uint32_t> chunkRanks(chunks + 1, 0);
+    scheduler.ParallelFor(chunks, options.threads, [&](unsigned chunk) {
+        const size_t begin = keyWords * chunk / chunks;
+        const size_t end = keyWords * (chunk + 1) / chunks;
+        uint32_t count = 0;
+        for (size_t w = begin; w < end; ++w)
+            count += __builtin_popcountll(keyBits[w]);
+        chunkRanks[chunk + 1] = count;
+    });
+    for (unsigned c = 0; c < chunks; ++c)
+        chunkRanks[c + 1] += chunkRanks[c];
+    if (chunkRanks[chunks] > maxNewCollisions)
+        drops.capped += chunkRanks[chunks] - maxNewCollisions;
+    scheduler.ParallelFor(chunks, options.threads, [&](unsigned chunk) {
+        const size_t begin = keyWords * chunk / chunks;
+        const size_t end = keyWords * (chunk + 1) / chunks;
+        uint32_t rank = chunkRanks[chunk];
+        for (size_t w = begin; w < end; ++w) {
+            keyRanks[w] = rank;
+            rank += __builtin_popcountll(keyBits[w]);
+        }
+    });
+    ForkTable& newForks = forks[forkLevels];
+    newForks.Clear();
+    scheduler.ParallelFor(chunks, options.threads, [&](unsigned chunk) {
+        const unsigned begin = (uint64_t)tableLength * chunk / chunks;
+        const unsigned end = (uint64_t)tableLength * (chunk + 1) / chunks;
+        for (unsigned row = begin; row < end; ++row) {
+            unsigned& filled = collisionList.Filled(row);
+            for (unsigned slot = 0; slot < filled; ++slot) {
+                uint32_t& reference = collisionList.Reference(row, slot);
+                const uint32_t key = reference;
+                const uint64_t below = keyBits[key / 64] & (((uint64_t)1 << (key % 64)) - 1);
+                const uint32_t rank = keyRanks[key / 64] + __builtin_popcountll(below);
+                if (rank >= maxNewCollisions) {
+                    //rows are sorted by key, the rest of the row is past the cap too
+                    filled = slot;
+                    break;
+                }
+                const unsigned i = key / pairSlots;
+                const unsigned j = key % pairSlots / rowSlots;
+                const unsigned m = key % rowSlots;
+                newForks.SetShared(rank, Fork(tupleList.Reference(i, j), tupleList.Reference(i, m)));
+                reference = rank;
+            }
+        }
+    });
+}
+
+void Equihash::CollideRows(unsigned begin, unsigned end, bool store,
+                           std::vector<uint32_t>& spill, std::vector<Fork>& found)
+{
+    if (tupleList.Narrow())
+        CollideRows<0, true>(begin, end, store, spill, found);
+    else
+        CollideRows<0, false>(begin, end, store, spill, found);
+}
+
+template<unsigned OLD_BLOCKS, bool NARROW>
+void Equihash::CollideRows(unsigned begin, unsigned end, bool store,
+                           std::vector<uint32_t>& spill, std::vector<Fork>& found)
+{
+    const unsigned oldBlocks = OLD_BLOCKS != 0 ? OLD_BLOCKS : tupleList.Blocks();
+    const unsigned oldWords = TupleTable::BlockWords(oldBlocks, NARROW);
+    const unsigned newWords = TupleTable::BlockWords(oldBlocks - 1, NARROW);
+    const unsigned rowSlots = RowSlots();
+    const unsigned pairSlots = rowSlots * rowSlots; //keys per source row
+    for (unsigned i = begin; i < end; ++i) {
+        const unsigned filled = tupleList.Filled(i);
+        for (unsigned j = 0; j < filled; ++j) {
+            const uint32_t* first = tupleList.Entry(i, j);
+            for (unsigned m = j + 1; m < filled; ++m) {
+                const uint32_t* second = tupleList.Entry(i, m);
+                uint32_t newIndex = NewRow<NARROW>(first, second);
+                if (store) {
+                    if (newIndex == 0 && SharesChild(first, second))
+                        __atomic_fetch_add(&stats.duplicates, 1, __ATOMIC_RELAXED);
+                    else if (newIndex == 0)
+                        found.push_back(Fork(first[oldWords], second[oldWords]));
+                    continue;
+                }
+                unsigned slot = AtomicIncrement(collisionList.Filled(newIndex));
+                uint32_t* entry;
+                if (slot < LIST_LENGTH) {
+                    entry = collisionList.Entry(newIndex, slot);
+                }
+                else {
+                    spill.push_back(newIndex);
+                    spill.resize(spill.size() + newWords + 1);
+                    entry = &spill[spill.size() - newWords - 1];
+                }
+                XorBlocks<NARROW>(entry, first, second, oldWords, newWords);
+                entry[newWords] = i * pairSlots + j * rowSlots + m;
+            }
+        }
+    }
+}
+
+bool Equihash::KeysFit(unsigned n, unsigned k, const SolverOptions& options)
+{
+    //a key numbers a collision by its source row and the slots of its two
+    //entries, and is kept in the 32-bit reference word of the new entry
+    const uint64_t rowSlots = options.spill ? LIST_LENGTH + SPILL_LENGTH : LIST_LENGTH;
+    return ((uint64_t)1 << (n / (k + 1))) * rowSlots * rowSlots <= (uint64_t)UINT32_MAX + 1;
+}
+
+bool Equihash::SolveNonce(Nonce nonce_in, std::vector<Input>& inputs){
+    nonce = nonce_in;
+    if (options.spill && !KeysFit(n, k, options))
+        return false; //only the parallel rounds read the spill area
+    //printf("Testing nonce %d\n", nonce);
+    stats.nonces++;
+    PhaseTimer timer(options.stats);
+    InitializeMemory(); //allocate
+    FillMemory(4UL << (n / (k + 1)-1));   //fill with hashes
+    timer.Lap(stats.fillNs, stats.fillCycles);
+    bool stopped = false;
+    for (unsigned i = 1; i <= k; ++i) {
+        if (Stopping()) {
+            stopped = true;
+            break;
+        }
+        bool to_store = (i == k);
+        ResolveCollisions(to_store); //XOR collisions, concatenate indices and shift
+        timer.Lap(stats.roundNs[i - 1], stats.roundCycles[i - 1]);
+    }
+    if (options.stats)
+        stats.peakBytes = std::max(stats.peakBytes, TableBytes());
+    if (stopped)
+        return false;
+
+    //Solutions with a repeated input were not kept
+    if (solutions.empty())
+        return false;
+    inputs = solutions[0].inputs;
+    return true;
 }
 
 Proof Equihash::FindProof(){
     //FILE* fp = fopen("proof.log", "w+");
     //fclose(fp);
+    std::vector<Proof> proofs = FindProofs(1);
+    if (proofs.empty())
+        return Proof(n, k, seed, MAX_NONCE, std::vector<uint32_t>());
+    return proofs[0];
+}
+
+std::vector<Proof> Equihash::FindProofs(unsigned count){
+    std::vector<Proof> proofs;
     this->nonce = 1;
-    while (nonce < MAX_NONCE) {
-        nonce++;
-        //printf("Testing nonce %d\n", nonce);
-        //uint64_t start_cycles = rdtsc();
-        InitializeMemory(); //allocate
-        FillMemory(4UL << (n / (k + 1)-1));   //fill with hashes
-        //uint64_t fill_end = rdtsc();
-        //printf("Filling %2.2f  Mcycles \n", (double)(fill_end - start_cycles) / (1UL << 20));
-        for (unsigned i = 1; i <= k; ++i) {
-            //uint64_t resolve_start = rdtsc();
-            bool to_store = (i == k);
-            ResolveCollisions(to_store); //XOR collisions, concatenate indices and shift
-            //uint64_t resolve_end = rdtsc();
-            //printf("Resolving %2.2f  Mcycles \n", (double)(resolve_end - resolve_start) / (1UL << 20));
-        }
-        //uint64_t stop_cycles = rdtsc();
-
-        //double  mcycles_d = (double)(stop_cycles - start_cycles) / (1UL << 20);
-        //uint32_t kbytes = (tupleList.size()*LIST_LENGTH*k*sizeof(uint32_t)) / (1UL << 10);
-        //printf("Time spent for n=%d k=%d  %d KiB: %2.2f  Mcycles \n",
-        //    n, k, kbytes,
-        //    mcycles_d);
-
-        //Duplicate check
-        for (unsigned i = 0; i < solutions.size(); ++i) {
-            auto vec = solutions[i].inputs;
-            std::sort(vec.begin(), vec.end());
-            bool dup = false;
-            for (unsigned k = 0; k < vec.size() - 1; ++k) {
-                if (vec[k] == vec[k + 1])
-                    dup = true;
-            }
-            if (!dup)
-                return solutions[i];
-        }
+    std::vector<Input> inputs;
+    while (nonce < MAX_NONCE && proofs.size() < count &&
+           (options.cancel == nullptr || !options.cancel->Stopped())) {
+        if (!SolveNonce(nonce + 1, inputs))
+            continue;
+        for (unsigned i = 0; i < solutions.size() && proofs.size() < count; ++i)
+            proofs.push_back(solutions[i]);
     }
-    return Proof(n, k, seed, nonce, std::vector<uint32_t>());
+    return proofs;
+}
+
+//Round kernels of a preset, picked by the block count of the table: k for
+//the first round down to 1 for the last
+template<unsigned BLOCKS, bool NARROW>
+struct PresetRounds{
+    static void Resolve(Equihash& solver, unsigned blocks, bool store) {
+        if (blocks == BLOCKS)
+            return solver.ResolveRows<BLOCKS, NARROW>(store);
+        PresetRounds<BLOCKS - 1, NARROW>::Resolve(solver, blocks, store);
+    }
+    static void Collide(Equihash& solver, unsigned blocks, unsigned begin, unsigned end, bool store,
+                        std::vector<uint32_t>& spill, std::vector<Fork>& found) {
+        if (blocks == BLOCKS)
+            return solver.CollideRows<BLOCKS, NARROW>(begin, end, store, spill, found);
+        PresetRounds<BLOCKS - 1, NARROW>::Collide(solver, blocks, begin, end, store, spill, found);
+    }
+};
+
+template<bool NARROW>
+struct PresetRounds<0, NARROW>{ //not reached, a table has at least one block
+    static void Resolve(Equihash& solver, unsigned, bool store) {
+        solver.ResolveRows<0, NARROW>(store);
+    }
+    static void Collide(Equihash& solver, unsigned, unsigned begin, unsigned end, bool store,
+                        std::vector<uint32_t>& spill, std::vector<Fork>& found) {
+        solver.CollideRows<0, NARROW>(begin, end, store, spill, found);
+    }
+};
+
+template<unsigned PRESET_N, unsigned PRESET_K>
+void PresetEquihash<PRESET_N, PRESET_K>::FillRows(uint32_t length)
+{
+    Equihash::FillRows<PRESET_K, BITS>(length);
+}
+
+template<unsigned PRESET_N, unsigned PRESET_K>
+void PresetEquihash<PRESET_N, PRESET_K>::FillRange(uint32_t begin, uint32_t end, std::vector<uint32_t>& spill)
+{
+    Equihash::FillRange<PRESET_K, BITS>(begin, end, spill);
+}
+
+template<unsigned PRESET_N, unsigned PRESET_K>
+void PresetEquihash<PRESET_N, PRESET_K>::ResolveRows(bool store)
+{
+    PresetRounds<PRESET_K, NARROW>::Resolve(*this, TableBlocks(), store);
+}
+
+template<unsigned PRESET_N, unsigned PRESET_K>
+void PresetEquihash<PRESET_N, PRESET_K>::CollideRows(unsigned begin, unsigned end, bool store,
+                                       std::vector<uint32_t>& spill, std::vector<Fork>& found)
+{
+    PresetRounds<PRESET_K, NARROW>::Collide(*this, TableBlocks(), begin, end, store, spill, found);
+}
+
+#define INSTANTIATE_PRESET(N, K) template class PresetEquihash<N, K>;
+EQUIHASH_PRESETS(INSTANTIATE_PRESET)
+#undef INSTANTIATE_PRESET
+
+Equihash* NewSolver(unsigned n, unsigned k, Seed seed)
+{
+#define NEW_PRESET(N, K) if (n == N && k == K) return new PresetEquihash<N, K>(seed);
+    EQUIHASH_PRESETS(NEW_PRESET)
+#undef NEW_PRESET
+    return new Equihash(n, k, seed);
 }
 
 bool Proof::Test()
 {
-    uint32_t input[SEED_LENGTH + 2];
-    for (unsigned i = 0; i < SEED_LENGTH; ++i)
-        input[i] = seed[i];
-    input[SEED_LENGTH] = nonce;
-    input[SEED_LENGTH + 1] = 0;
-    uint32_t buf[MAX_N / 4];
-    std::vector<uint32_t> blocks(k+1,0);
-    for (unsigned i = 0; i < inputs.size(); ++i) {
-        input[SEED_LENGTH + 1] = inputs[i];
-        blake2b((uint8_t*)buf, &input, NULL, sizeof(buf), sizeof(input), 0);
+    return TestInputs(n, k, seed, nonce, inputs.data(), inputs.size());
+}
+
+//K and BITS fix k and n/(k+1) at compile time, 0 takes them from the arguments
+template<unsigned K, unsigned BITS>
+static bool TestTree(unsigned k, unsigned bits, const Seed& seed, Nonce nonce, const Input* inputs, size_t count)
+{
+    if (K != 0) {
+        k = K;
+        bits = BITS;
+    }
+    //subtrees of 2^h inputs, built in input order, must collide on block
+    //h-1 and the whole tree on the last block too; the first subtree that
+    //does not stops the check, so later inputs are never hashed
+    IndexHasher hasher(seed, nonce);
+    uint32_t subtrees[MAX_N / 4][MAX_N / 4];
+    unsigned heights[MAX_N / 4];
+    unsigned depth = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        const uint32_t* buf = hasher.Next(inputs, i, count);
         for (unsigned j = 0; j < (k + 1); ++j) {
             //select j-th block of n/(k+1) bits
-            blocks[j] ^= buf[j] >> (32 - n / (k + 1));
+            subtrees[depth][j] = buf[j] >> (32 - bits);
+        }
+        heights[depth++] = 0;
+        while (depth > 1 && heights[depth - 2] == heights[depth - 1]) {
+            depth--;
+            uint32_t* merged = subtrees[depth - 1];
+            for (unsigned j = heights[depth - 1]; j < (k + 1); ++j)
+                merged[j] ^= subtrees[depth][j];
+            if (merged[heights[depth - 1]++] != 0)
+                return false;
         }
     }
-    bool b = true;
-    for (unsigned j = 0; j < (k + 1); ++j) {
-        b &= (blocks[j] == 0);
-    }
+    bool b = subtrees[0][k] == 0;
     /*
-    if (b && inputs.size()!=0)    {
+    if (b && count!=0)    {
         printf("Solution found:\n");
-        for (unsigned i = 0; i < inputs.size(); ++i) {
+        for (unsigned i = 0; i < count; ++i) {
             printf(" %x ", inputs[i]);
         }
         printf("%i\n", b);
     }*/
     return b;
 }
+
+bool TestInputs(unsigned n, unsigned k, const Seed& seed, Nonce nonce, const Input* inputs, size_t count)
+{
+    //structure first, so that malformed proofs cost no hashing: 2^k
+    //distinct inputs within the range the solver fills
+    const unsigned bits = n / (k + 1);
+    if (k + 1 > MAX_N / 4 || count != (size_t)1 << k)
+        return false; //more blocks than one hash holds, or a wrong length
+    Input sorted[1 << (MAX_N / 4 - 1)];
+    std::copy(inputs, inputs + count, sorted);
+    std::sort(sorted, sorted + count);
+    if (std::adjacent_find(sorted, sorted + count) != sorted + count || sorted[count - 1] >= (2ULL << bits))
+        return false;
+#define TEST_PRESET(N, K) \
+    if (n == N && k == K) \
+        return TestTree<K, N / (K + 1)>(k, bits, seed, nonce, inputs, count);
+    EQUIHASH_PRESETS(TEST_PRESET)
+#undef TEST_PRESET
+    return TestTree<0, 0>(k, bits, seed, nonce, inputs, count);
+}
@@ -5,18 +5,45 @@ CC0 license
 #ifndef __POW
 #define __POW
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 
 #include <vector>
 #include <cstdio>
 
+#include "cpu.h"
+
 
 const int SEED_LENGTH=16; //Length of seed in dwords ;
 const int NONCE_LENGTH=24; //Length of nonce in bytes;
 const int MAX_NONCE = 0xFFFFF;
 const int MAX_N = 32; //Max length of n in bytes, should not exceed 32
+const unsigned HASH_BATCH = 16; //Inputs hashed per BLAKE2b kernel call
 const int LIST_LENGTH = 5;
 const unsigned FORK_MULTIPLIER=3; //Maximum collision factor
+const unsigned SPILL_LENGTH = LIST_LENGTH; //Extra entries per row in the spill area
+/* Rows get about two entries each (Poisson with mean 2) in the fill, so
+   about 1.7% of the rows and 1.1% of the entries find their row full, on
+   average 0.0225 entries past LIST_LENGTH per row. The spill area holds
+   rows/SPILL_FRACTION entries, 0.031 per row: a margin of only about 1.4,
+   which a round running above the mean can use up. Entries past it are
+   dropped as they are without spill; at 90/5, doubling the area changes
+   no drop count.
+*/
+const unsigned SPILL_FRACTION = 32;
+/* Entries that find their row full in a parallel fill or round are set
+   aside per work chunk until they are merged. About 0.02 entries per row
+   are expected; memoryLimit budgets rows/OVERFLOW_FRACTION of them, which
+   also covers rounds above the mean and the growth of the vectors.
+*/
+const unsigned OVERFLOW_FRACTION = 8;
+const unsigned CACHE_LINE = 64; //Bytes, alignment of tuple table rows
+const unsigned MAX_TRUNCATE_BITS = 8; //Leaf reference bits that can be dropped from the forks
+const unsigned NARROW_BITS = 16; //Blocks up to this width are stored two per word
+const unsigned NARROW_ROW_ALIGN = 16; //Bytes, alignment of narrow table rows
+const size_t HUGE_PAGE = 2 << 20; //Bytes, smallest table mapped for huge pages
+const unsigned ANY_NODE = 0xFFFFFFFF; //Tables not bound to a NUMA node
 
 /* The block used to initialize the PoW search
    @v actual values
@@ -86,16 +113,104 @@ struct Proof{
       bool Test();
 };
 
-  class Tuple {
-  public:
-      std::vector<uint32_t> blocks;
-      Input reference;
-      Tuple(unsigned i) { blocks.resize(i); }
-      Tuple& operator=(const Tuple &r) {
-          blocks = r.blocks;
-          reference = r.reference;
+//true if the hashes of the inputs xor to zero in every block
+bool TestInputs(unsigned n, unsigned k, const Seed& seed, Nonce nonce, const Input* inputs, size_t count);
+
+/* Pages behind the tuple tables, from the least to the most preferred:
+   ordinary allocations, mappings that transparent huge pages may back, and
+   mappings from the reserved huge page pool
+*/
+enum MemoryBacking { BACKING_DEFAULT, BACKING_TRANSPARENT, BACKING_HUGETLB };
+const char* BackingName(MemoryBacking backing);
+
+/* Backing obtained for the tables of one or more solvers */
+struct TableMemory{
+      MemoryBacking backing;  //the least preferred backing of any table
+      bool locked;            //every table is locked in RAM
+      bool bound;             //every table is bound to the NUMA node of its solver
+      TableMemory() : backing(BACKING_HUGETLB), locked(true), bound(true) {};
+      TableMemory& operator+=(const TableMemory& r) {
+          backing = backing < r.backing ? backing : r.backing;
+          locked = locked && r.locked;
+          bound = bound && r.bound;
           return *this;
       }
+};
+
+/* Contiguous hash table of tuples. Every row holds up to LIST_LENGTH entries,
+   each entry stores its blocks followed by the reference, and rows are padded
+   to a whole number of cache lines. The storage is only reallocated when a
+   larger table is requested, so reusing the table costs a counter reset.
+   With a spill area, slots from LIST_LENGTH on of a full row live there,
+   contiguous per row from spillStart[row].
+   A narrow table keeps two blocks per word, block 2i in the low half of
+   word i; the high half of the last word is zero for an odd block count.
+   Its rows are only padded to NARROW_ROW_ALIGN bytes, as the few entries
+   a row holds on average sit within one or two cache lines either way.
+   With huge pages, locking or a NUMA node requested, the storage is
+   reallocated the next time the table is reset if it was allocated without
+   them.
+*/
+  class TupleTable {
+      uint32_t* data;
+      size_t capacity;           //allocated words
+      size_t mapped;             //bytes mapped for data, 0 if it came from the heap
+      MemoryBacking backing;
+      bool locked;
+      bool hugeWanted;           //requested for the next allocation
+      bool lockWanted;
+      bool hugeAsked;            //requested when data was allocated
+      bool lockAsked;
+      bool bound;
+      unsigned nodeWanted;       //ANY_NODE, or the NUMA node to bind data to
+      unsigned nodeAsked;
+      void Allocate(size_t words);
+      void Free();
+      std::vector<unsigned> filled;  //number of entries in rows
+      unsigned rows;
+      unsigned blockCount;
+      unsigned wordCount;        //words holding the blocks of an entry
+      bool narrow;
+      unsigned entryStride;      //words per entry
+      unsigned rowStride;        //words per row
+      std::vector<uint32_t> spillArea;   //entries past LIST_LENGTH
+      std::vector<uint32_t> spillStart;  //first spill entry of every row
+      unsigned spillCapacity;    //entries in the spill area
+      TupleTable(const TupleTable&);
+      TupleTable& operator=(const TupleTable&);
+  public:
+      TupleTable() : data(nullptr), capacity(0), mapped(0), backing(BACKING_DEFAULT), locked(false),
+          hugeWanted(false), lockWanted(false), hugeAsked(false), lockAsked(false), bound(false),
+          nodeWanted(ANY_NODE), nodeAsked(ANY_NODE), rows(0), blockCount(0),
+          wordCount(0), narrow(false), entryStride(0), rowStride(0), spillCapacity(0) {};
+      ~TupleTable();
+      //empty table of given shape
+      void Reset(unsigned rows_in, unsigned blocks_in, bool narrow_in, unsigned spill = 0);
+      void Swap(TupleTable& r);
+      void SetPaging(bool huge, bool lock) { hugeWanted = huge; lockWanted = lock; }
+      void SetNode(unsigned node) { nodeWanted = node; }
+      TableMemory Memory() const; //backing of the storage
+      unsigned Rows() const { return rows; }
+      unsigned Blocks() const { return blockCount; }
+      unsigned Words() const { return wordCount; }
+      bool Narrow() const { return narrow; }
+      static unsigned BlockWords(unsigned blocks, bool narrow) { return narrow ? (blocks + 1) / 2 : blocks; }
+      static unsigned RowStride(unsigned blocks, bool narrow); //words per row
+      unsigned& Filled(unsigned row) { return filled[row]; }
+      uint32_t* Entry(unsigned row, unsigned slot) {
+          if (slot < LIST_LENGTH)
+              return data + (size_t)row * rowStride + slot * entryStride;
+          return &spillArea[(size_t)(spillStart[row] + slot - LIST_LENGTH) * entryStride];
+      }
+      unsigned SpillCapacity() const { return spillCapacity; }
+      uint32_t* SpillEntry(unsigned index) { return &spillArea[(size_t)index * entryStride]; }
+      void SetSpillStart(unsigned row, unsigned index) { spillStart[row] = index; }
+      uint32_t& Reference(unsigned row, unsigned slot) { return Entry(row, slot)[wordCount]; }
+      void Prefault(); //touch every allocated page
+      size_t Bytes() const { //allocated, spill area included
+          return capacity * sizeof(uint32_t) +
+              (filled.capacity() + spillArea.capacity() + spillStart.capacity()) * sizeof(uint32_t);
+      }
   };
 
   class Fork {
@@ -105,32 +220,285 @@ struct Proof{
       Fork(Input r1, Input r2) : ref1(r1), ref2(r2) {};
   };
 
+/* Forks of one round with both references packed in refBits bits each,
+   cut to their low refBits bits. Forks that share a word can be written
+   from several threads with SetShared, which ORs them atomically into
+   storage zeroed by Clear.
+*/
+  class ForkTable {
+      std::vector<uint64_t> words;
+      unsigned count;
+      unsigned refBits;
+  public:
+      ForkTable() : count(0), refBits(0) {};
+      void Reset(unsigned count_in, unsigned bits); //room for count forks
+      void Clear(); //zero all forks
+      size_t Allocated() const { return words.capacity() * sizeof(uint64_t); }
+      unsigned Size() const { return count; }
+      unsigned RefBits() const { return refBits; }
+      void Set(unsigned index, Fork fork) {
+          const uint64_t mask = ((uint64_t)1 << refBits) - 1;
+          const uint64_t field = mask << refBits | mask;
+          const uint64_t value = (fork.ref1 & mask) | (fork.ref2 & mask) << refBits;
+          const uint64_t bit = (uint64_t)index * 2 * refBits;
+          const unsigned shift = bit % 64;
+          words[bit / 64] = (words[bit / 64] & ~(field << shift)) | value << shift;
+          if (shift + 2 * refBits > 64)
+              words[bit / 64 + 1] = (words[bit / 64 + 1] & ~(field >> (64 - shift))) | value >> (64 - shift);
+      }
+      void SetShared(unsigned index, Fork fork);
+      Fork Get(unsigned index) const {
+          const uint64_t mask = ((uint64_t)1 << refBits) - 1;
+          const uint64_t bit = (uint64_t)index * 2 * refBits;
+          const unsigned shift = bit % 64;
+          uint64_t value = words[bit / 64] >> shift;
+          if (shift + 2 * refBits > 64)
+              value |= words[bit / 64 + 1] << (64 - shift);
+          return Fork(value & mask, value >> refBits & mask);
+      }
+      static size_t Bytes(unsigned count, unsigned bits) { return ((size_t)count * 2 * bits / 64 + 2) * 8; }
+  };
+
+/* Why a solve stopped before it was done */
+enum StopReason { STOP_NONE, STOP_ABORTED, STOP_TIMEOUT };
+
+/* Stop request for one solve, checked between nonces and between rounds.
+   Abort may be called from any thread; the deadline trips on the first
+   check after it passes. The first reason set is kept.
+*/
+class SolveCancel{
+      mutable std::atomic<unsigned> reason;
+      std::chrono::steady_clock::time_point deadline;
+      bool timed;
+      void Stop(StopReason r) const {
+          unsigned none = STOP_NONE;
+          reason.compare_exchange_strong(none, r);
+      }
+public:
+      SolveCancel() : reason(STOP_NONE), timed(false) {};
+      void SetDeadline(uint64_t ms) { //from now
+          deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+          timed = true;
+      }
+      void Abort() { Stop(STOP_ABORTED); }
+      bool Stopped() const {
+          if (reason.load(std::memory_order_relaxed) != STOP_NONE)
+              return true;
+          if (timed && std::chrono::steady_clock::now() >= deadline)
+              Stop(STOP_TIMEOUT);
+          return reason.load(std::memory_order_relaxed) != STOP_NONE;
+      }
+      StopReason Reason() const { return (StopReason)reason.load(); }
+};
+
+/* Tuning knobs of a search. Unless firstWins is set they change how the
+   search runs, not which proof it finds.
+*/
+struct SolverOptions{
+      unsigned threads;       //threads working on one nonce
+      unsigned parallelNonces; //nonces solved at the same time
+      bool firstWins;         //return the first proof found, not the lowest nonce
+      size_t memoryLimit;     //bytes of solver memory for nonces in flight, 0 for no limit
+      bool spill;             //keep entries of full rows in a spill area (changes the proof)
+      unsigned truncateBits;  //high leaf index bits left out of the forks, recomputed for solutions
+      unsigned maxSolutions;  //solutions to collect, all of a nonce before the next one
+      bool hugePages;         //map the tuple tables for huge pages, with fallback
+      bool lockMemory;        //lock the tuple tables in RAM, which also faults their pages in
+      bool numa;              //pin workers to NUMA nodes and keep each nonce's tables on its node
+      const SolveCancel* cancel; //stops the solve between nonces and rounds, may be nullptr
+      bool stats;             //time the phases of every nonce into SolveStats
+      SolverOptions() : threads(1), parallelNonces(1), firstWins(false), memoryLimit(0), spill(false),
+          truncateBits(0), maxSolutions(1), hugePages(false), lockMemory(false),
+          numa(false), cancel(nullptr), stats(false) {};
+};
+
+/* Entries lost by a solver: tuples that found their row (and spill area)
+   full, and collisions past the fork limit of a round. The total does not
+   depend on the thread count, the split between the two can.
+*/
+struct DropCounts{
+      uint64_t tuples;
+      uint64_t capped;
+      DropCounts() : tuples(0), capped(0) {};
+      DropCounts& operator+=(const DropCounts& r) {
+          tuples += r.tuples;
+          capped += r.capped;
+          return *this;
+      }
+};
+
+/* Work of a solver over the nonces it tried, collected with
+   SolverOptions::stats. Phase times are wall time in nanoseconds and time
+   stamp counter cycles (0 without one); rounds[i] is round i+1. Table
+   bytes only grow, so peakBytes is the largest any solver held; a search
+   sums it over its solvers.
+*/
+struct SolveStats{
+      uint64_t nonces;
+      uint64_t duplicates;        //last-round candidates that repeat an input, in their last fork or deeper
+      uint64_t fillNs;
+      uint64_t fillCycles;
+      uint64_t roundNs[MAX_N / 4];
+      uint64_t roundCycles[MAX_N / 4];
+      size_t peakBytes;           //tuple tables and forks
+      SolveStats() : nonces(0), duplicates(0), fillNs(0), fillCycles(0), roundNs(), roundCycles(),
+          peakBytes(0) {};
+      SolveStats& operator+=(const SolveStats& r) {
+          nonces += r.nonces;
+          duplicates += r.duplicates;
+          fillNs += r.fillNs;
+          fillCycles += r.fillCycles;
+          for (unsigned i = 0; i < MAX_N / 4; ++i) {
+              roundNs[i] += r.roundNs[i];
+              roundCycles[i] += r.roundCycles[i];
+          }
+          peakBytes = peakBytes > r.peakBytes ? peakBytes : r.peakBytes;
+          return *this;
+      }
+};
+
+/* Shared by the solvers of one search so that a proof found by one of them
+   stops the others
+*/
+struct SearchControl{
+      std::atomic<uint32_t> bestNonce;  //last nonce needed for the proofs found so far
+      const bool firstWins;
+      explicit SearchControl(bool first) : bestNonce(UINT32_MAX), firstWins(first) {};
+      bool Abandon(Nonce nonce) const {
+          uint32_t best = bestNonce.load(std::memory_order_relaxed);
+          return firstWins ? best != UINT32_MAX : nonce > best;
+      }
+};
+
 /*Algorithm class for creating proof
   Assumes that n/(k+1) <=32
 *
 */
 class Equihash{
-      std::vector<std::vector<Tuple>> tupleList;
-      std::vector<unsigned> filledList;
+      TupleTable tupleList;
+      TupleTable collisionList;   //next round's table, kept to reuse its memory
       std::vector<Proof> solutions;
-      std::vector<std::vector<Fork>> forks;
+      std::vector<ForkTable> forks;
+      unsigned forkLevels;        //number of valid entries in forks
+      std::vector<std::vector<uint32_t>> overflow; //entries that found their row full, per work chunk
+      std::vector<std::vector<Fork>> candidates;   //zero collisions of the last round, per work chunk
+      std::vector<uint64_t> keyBits;   //collisions kept in a parallel round, by generation order
+      std::vector<uint32_t> keyRanks;  //kept collisions before each word of keyBits
+      std::vector<std::pair<Fork, unsigned>> treeStack; //forks and their levels left to resolve
+      std::vector<uint64_t> treeSeen;  //inputs of the tree being resolved, tagged with treeStamp
+      uint32_t treeStamp;
+      std::vector<Input> treeInputs;   //inputs of the last candidate resolved
+      SolverOptions options;
+      SearchControl* control;     //set while the solver is part of a parallel search
+      DropCounts drops;           //since the last ResetDrops
+      SolveStats stats;           //since the last ResetStats
       unsigned n;
       unsigned k;
+      unsigned node;              //NUMA node of the tables, or ANY_NODE
       Seed seed;
       Nonce nonce;
+      bool Stopping() const {
+          return (control != nullptr && control->Abandon(nonce)) ||
+              (options.cancel != nullptr && options.cancel->Stopped());
+      }
 public:
       /*
       Initializes memory.
       */
-      Equihash(unsigned n_in, unsigned k_in, Seed s) :n(n_in), k(k_in), seed(s) {};
-      ~Equihash() {};
+      Equihash(unsigned n_in, unsigned k_in, Seed s) :forkLevels(0), treeStamp(0), control(nullptr), n(n_in), k(k_in),
+          node(ANY_NODE), seed(s) {};
+      virtual ~Equihash() {};
+      unsigned N() const { return n; }
+      unsigned K() const { return k; }
+      unsigned Node() const { return node; }
+      void SetNode(unsigned nd) {
+          node = nd;
+          tupleList.SetNode(nd);
+          collisionList.SetNode(nd);
+      }
+      void SetSeed(const Seed& s) { seed = s; }
+      void SetOptions(const SolverOptions& o) {
+          options = o;
+          tupleList.SetPaging(o.hugePages, o.lockMemory);
+          collisionList.SetPaging(o.hugePages, o.lockMemory);
+      }
+      TableMemory Memory() const; //backing of the tuple tables
+      void SetControl(SearchControl* c) { control = c; }
+      const DropCounts& Drops() const { return drops; }
+      void ResetDrops() { drops = DropCounts(); }
+      const SolveStats& Stats() const { return stats; }
+      void ResetStats() { stats = SolveStats(); }
+      size_t TableBytes() const; //tuple tables and forks allocated now
+      static size_t MemoryFootprint(unsigned n, unsigned k, const SolverOptions& options); //bytes used by one solve
+      size_t MemoryFootprint() const { return MemoryFootprint(n, k, options); } //with the last options set
+      //true if the collision keys of a parallel round fit in 32 bits; rounds
+      //without spill run serially otherwise, and spill finds no proof
+      static bool KeysFit(unsigned n, unsigned k, const SolverOptions& options);
+      unsigned SpillEntries(unsigned rows) const; //spill area size, 0 without spill
+      unsigned ForkCapacity(unsigned rows) const; //forks kept per round
+      unsigned ForkBits(unsigned level, unsigned rows) const; //bits per reference in forks[level]
+      unsigned RowSlots() const { return options.spill ? LIST_LENGTH + SPILL_LENGTH : LIST_LENGTH; }
+      bool Narrow() const { return n / (k + 1) <= NARROW_BITS; } //blocks fit in half a word
+      unsigned TableBlocks() const { return tupleList.Blocks(); } //blocks left after the row index
 	Proof FindProof();
+      std::vector<Proof> FindProofs(unsigned count); //first count solutions in nonce order
+      bool SolveNonce(Nonce nonce_in, std::vector<Input>& inputs); //false if no proof or abandoned
+      const std::vector<Proof>& Solutions() const { return solutions; } //of the last nonce solved
+      void Prefault(); //allocate tables and forks for all rounds and touch their pages
       void FillMemory(uint32_t length);      //fill with hash
+      virtual void FillRows(uint32_t length); //serial fill, with the shape of a preset if there is one
+      //K and BITS fix k and n/(k+1) at compile time, 0 takes them from the solver
+      template<unsigned K, unsigned BITS> MULTIVERSION void FillRows(uint32_t length);
+      void FillMemoryParallel(uint32_t length);
+      virtual void FillRange(uint32_t begin, uint32_t end, std::vector<uint32_t>& spill);
+      template<unsigned K, unsigned BITS> MULTIVERSION void FillRange(uint32_t begin, uint32_t end,
+                                                                       std::vector<uint32_t>& spill);
+      void MergeOverflow(TupleTable& table, unsigned chunks); //keep the smallest references per row
+      void SpillOverflow(TupleTable& table, unsigned chunks);
       void InitializeMemory(); //allocate memory
       void ResolveCollisions(bool store);
-      std::vector<Input> ResolveTree(Fork fork);
-      std::vector<Input> ResolveTreeByLevel(Fork fork, unsigned level);
+      virtual void ResolveRows(bool store); //serial round over the current table
+      //OLD_BLOCKS fixes the blocks of the table at compile time, 0 takes them from it
+      template<unsigned OLD_BLOCKS, bool NARROW> MULTIVERSION void ResolveRows(bool store);
+      void ResolveCollisionsParallel(bool store);
+      bool SharesChild(const uint32_t* first, const uint32_t* second) const; //forks of two entries
+      virtual void CollideRows(unsigned begin, unsigned end, bool store,
+                               std::vector<uint32_t>& spill, std::vector<Fork>& found);
+      template<unsigned OLD_BLOCKS, bool NARROW> MULTIVERSION void CollideRows(unsigned begin, unsigned end,
+                                                                               bool store,
+                                                                               std::vector<uint32_t>& spill,
+                                                                               std::vector<Fork>& found);
+      bool MarkInput(Input input); //false if the tree being resolved has it already
+      bool ResolveTree(Fork fork, Input* out); //writes the 2^k inputs, false if one repeats
+      bool RecoverTree(Fork fork, Input* out); //ResolveTree with truncated leaf references
+      void AddSolution(Fork fork); //keeps a last-round candidate whose inputs are distinct
       void PrintTuples(FILE* fp);
 };
 
+/* Parameter sets with a solver and a verifier compiled for their shape.
+   EQUIHASH_PRESETS(X) expands X(n, k) once per set
+*/
+#define EQUIHASH_PRESETS(X) X(90, 5) X(96, 5) X(144, 5)
+
+/* Solver with n and k fixed at compile time: the fill runs with a constant
+   block count and width, and each round with the constant block count of
+   its table, so the tuple loops have constant bounds and offsets.
+   Instantiated in pow.cc for EQUIHASH_PRESETS
+*/
+template<unsigned PRESET_N, unsigned PRESET_K>
+class PresetEquihash : public Equihash{
+public:
+      static const unsigned BITS = PRESET_N / (PRESET_K + 1);
+      static const bool NARROW = BITS <= NARROW_BITS;
+      explicit PresetEquihash(Seed s) : Equihash(PRESET_N, PRESET_K, s) {};
+      void FillRows(uint32_t length);
+      void FillRange(uint32_t begin, uint32_t end, std::vector<uint32_t>& spill);
+      void ResolveRows(bool store);
+      void CollideRows(unsigned begin, unsigned end, bool store,
+                       std::vector<uint32_t>& spill, std::vector<Fork>& found);
+};
+
+//the PresetEquihash of (n, k), or the runtime solver for other sets
+Equihash* NewSolver(unsigned n, unsigned k, Seed seed);
+
 #endif //define __POW
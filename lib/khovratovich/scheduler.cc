@@ -0,0 +1,292 @@
+/* Work-stealing scheduler that runs every parallel part of a solve. */
+
+#include "scheduler.h"
+#include "numa.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+struct Scheduler::Group {
+    std::atomic<unsigned> remaining;  //tasks of the group not finished
+    std::atomic<unsigned> active;     //threads working on the group, its caller included
+    unsigned limit;                   //threads the caller asked for
+};
+
+thread_local Scheduler::Worker* Scheduler::current = nullptr;
+thread_local Scheduler::Group* Scheduler::waiting = nullptr;
+
+//Keeps workers from starting more work once the process is exiting
+static void StopAtExit() {
+    Scheduler::Instance().Stop();
+}
+
+Scheduler& Scheduler::Instance() {
+    //never destroyed: libuv threads may still be inside ParallelFor and
+    //workers inside a nonce when the process exits
+    static Scheduler* scheduler = new Scheduler;
+    static const bool registered = std::atexit(StopAtExit) == 0;
+    (void)registered;
+    return *scheduler;
+}
+
+void Scheduler::Stop() {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+    wake.notify_all();
+}
+
+void Scheduler::Reserve(unsigned count) {
+    std::lock_guard<std::mutex> lock(mutex);
+    count = std::min(count, MAX_WORKERS);
+    while (workerCount.load(std::memory_order_relaxed) < count) {
+        const unsigned slot = workerCount.load(std::memory_order_relaxed);
+        if (slot < threads.size()) { //a retired worker, its thread has returned or is returning
+            threads[slot].join();
+            workers[slot]->placed = false;
+            workers[slot]->placing = false;
+        }
+        else {
+            workers[slot] = new Worker;
+            workers[slot]->node = slot % NumaNodes();
+            threads.push_back(std::thread());
+        }
+        workerCount.fetch_add(1, std::memory_order_release);
+        threads[slot] = std::thread(&Scheduler::WorkerLoop, this, workers[slot]);
+    }
+}
+
+//Joins the group of a task unless the thread is its caller, false if the
+//group already has as many threads as it asked for
+bool Scheduler::Claim(Task& task) {
+    task.claimed = task.group != waiting;
+    if (!task.claimed)
+        return true;
+    unsigned active = task.group->active.load(std::memory_order_relaxed);
+    while (active < task.group->limit) {
+        if (task.group->active.compare_exchange_weak(active, active + 1))
+            return true;
+    }
+    return false;
+}
+
+bool Scheduler::PopTask(Task& task) {
+    if (queued.load(std::memory_order_relaxed) == 0)
+        return false;
+    if (current != nullptr) {   //own deque, newest first
+        std::lock_guard<std::mutex> lock(current->mutex);
+        if (!current->tasks.empty()) {
+            task = current->tasks.back();
+            if (Claim(task)) {
+                current->tasks.pop_back();
+                queued--;
+                return true;
+            }
+        }
+    }
+    {
+        //callers outside the scheduler share this deque, so a task of a
+        //full group does not hide the tasks of the others behind it
+        std::lock_guard<std::mutex> lock(injected.mutex);
+        for (std::deque<Task>::iterator it = injected.tasks.begin(); it != injected.tasks.end(); ++it) {
+            task = *it;
+            if (Claim(task)) {
+                injected.tasks.erase(it);
+                queued--;
+                return true;
+            }
+        }
+    }
+    //steal the oldest task of another worker, starting at a moving victim;
+    //placed workers first try the workers of their own node
+    static thread_local unsigned victim = 0;
+    const unsigned count = workerCount.load(std::memory_order_acquire);
+    const bool local = current != nullptr && current->placed;
+    for (unsigned pass = local ? 0 : 1; pass < 2; ++pass) {
+        for (unsigned i = 0; i < count; ++i) {
+            Worker* worker = workers[(victim + i) % count];
+            if (worker == current || (pass == 0 && worker->node != current->node))
+                continue;
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            if (!worker->tasks.empty()) {
+                task = worker->tasks.front();
+                if (!Claim(task))
+                    continue;
+                worker->tasks.pop_front();
+                queued--;
+                victim += i;
+                return true;
+            }
+        }
+    }
+    victim++;
+    return false;
+}
+
+void Scheduler::Run(const Task& task) {
+    (*task.fn)(task.index);
+    if (task.claimed)
+        task.group->active--;
+    //the group may be gone once its last task is counted
+    const bool last = task.group->remaining.fetch_sub(1) == 1;
+    if (task.claimed || last) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (task.claimed)
+            epoch++; //tasks left for want of a thread of the group can be taken
+        wake.notify_all();
+    }
+}
+
+bool Scheduler::RunSource() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (unsigned tries = 0; tries < sources.size(); ++tries) {
+        const unsigned index = (nextSource + tries) % sources.size();
+        NonceSource* source = sources[index];
+        source->users++;
+        lock.unlock();
+        const bool ran = source->RunNext();
+        lock.lock();
+        if (--source->users == 0)
+            wake.notify_all();
+        if (ran) {
+            nextSource = index + 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Scheduler::RunOne(bool allowNonces) {
+    Task task;
+    if (PopTask(task)) {
+        Run(task);
+        return true;
+    }
+    return allowNonces && RunSource();
+}
+
+uint64_t Scheduler::Epoch() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return epoch;
+}
+
+void Scheduler::WaitForWork(uint64_t seenEpoch) {
+    std::unique_lock<std::mutex> lock(mutex);
+    wake.wait(lock, [this, seenEpoch] {
+        return epoch != seenEpoch;
+    });
+}
+
+void Scheduler::Notify() {
+    std::lock_guard<std::mutex> lock(mutex);
+    epoch++;
+    wake.notify_all();
+}
+
+void Scheduler::BeginNodePlacement() {
+    if (NumaNodes() > 1)
+        byNode++;
+}
+
+void Scheduler::EndNodePlacement() {
+    if (NumaNodes() > 1)
+        byNode--;
+}
+
+//Pins or unpins once each time placement turns on or off; a pin that fails
+//is not retried before the next time it turns on
+void Scheduler::Place(Worker* self, bool on) {
+    self->placing = on;
+    if (on)
+        self->placed = PinToNode(self->node);
+    else {
+        Unpin();
+        self->placed = false;
+    }
+}
+
+//Retires the last worker once it has been idle for IDLE_WORKER_MS; Reserve
+//starts it again when a search needs it
+bool Scheduler::Retire(Worker* self) {
+    const unsigned count = workerCount.load(std::memory_order_relaxed);
+    if (workers[count - 1] != self)
+        return false;
+    workerCount.store(count - 1, std::memory_order_release);
+    return true;
+}
+
+void Scheduler::WorkerLoop(Worker* self) {
+    current = self;
+    for (;;) {
+        const bool on = byNode.load(std::memory_order_relaxed) != 0;
+        if (self->placing != on)
+            Place(self, on);
+        const uint64_t seen = Epoch();
+        if (stopping.load(std::memory_order_relaxed))
+            return;
+        if (RunOne(true))
+            continue;
+        std::unique_lock<std::mutex> lock(mutex);
+        const bool woken = wake.wait_for(lock, std::chrono::milliseconds(IDLE_WORKER_MS), [this, seen] {
+            return stopping || epoch != seen;
+        });
+        if (stopping || (!woken && Retire(self)))
+            return;
+    }
+}
+
+void Scheduler::ParallelFor(unsigned count, unsigned threads, const std::function<void(unsigned)>& task) {
+    if (std::min(threads, count) <= 1) {
+        for (unsigned i = 0; i < count; ++i)
+            task(i);
+        return;
+    }
+    const unsigned helpers = std::min(threads, count) - 1; //the caller works too
+    if (workerCount.load(std::memory_order_relaxed) < helpers)
+        Reserve(helpers);
+    Group group;
+    group.remaining = count;
+    group.active = 1;
+    group.limit = std::min(threads, count);
+    Group* const outer = waiting;
+    waiting = &group;
+    Worker* owner = current != nullptr ? current : &injected;
+    {
+        std::lock_guard<std::mutex> lock(owner->mutex);
+        //tasks run in index order: a worker pops its own deque from the back,
+        //so it gets them in reverse, while injected tasks are taken from the front
+        for (unsigned i = 0; i < count; ++i)
+            owner->tasks.push_back(Task{&task, owner == &injected ? i : count - 1 - i, &group, false});
+        queued += count;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        epoch++;
+        wake.notify_all();
+    }
+    while (group.remaining.load() != 0) {
+        const uint64_t seen = Epoch();
+        Task stolen;
+        if (PopTask(stolen)) {
+            Run(stolen);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this, &group, seen] {
+            return group.remaining.load() == 0 || epoch != seen;
+        });
+    }
+    waiting = outer;
+}
+
+void Scheduler::AddSource(NonceSource* source) {
+    std::lock_guard<std::mutex> lock(mutex);
+    sources.push_back(source);
+    epoch++;
+    wake.notify_all();
+}
+
+void Scheduler::RemoveSource(NonceSource* source) {
+    std::unique_lock<std::mutex> lock(mutex);
+    sources.erase(std::remove(sources.begin(), sources.end(), source), sources.end());
+    wake.wait(lock, [source] { return source->users == 0; });
+}
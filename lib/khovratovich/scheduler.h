@@ -0,0 +1,109 @@
+/* Work-stealing scheduler that runs every parallel part of a solve.
+
+   Work comes in two kinds. Fill chunks and round row ranges are tasks that a
+   thread pushes onto its own deque with ParallelFor; it runs them newest
+   first while idle threads steal the oldest ones. Whole nonces come from the
+   registered NonceSources (one per parallel search), and a thread only
+   starts a new nonce when no task is left to steal. A nonce that is behind
+   therefore gets help with its rounds before more nonces, and more solver
+   memory, are taken on. Each source caps how many of its nonces are in
+   flight, and each ParallelFor how many threads work on its tasks at once.
+   Worker threads are started on demand and exit after IDLE_WORKER_MS idle.
+
+   While a search asks for node placement, every worker thread is pinned to
+   one NUMA node, round-robin, and steals from workers of its own node before
+   any other.
+*/
+
+#ifndef __SCHEDULER
+#define __SCHEDULER
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+const unsigned CHUNKS_PER_THREAD = 4; //Work items per thread, for load balance
+const unsigned MAX_WORKERS = 256;
+const unsigned IDLE_WORKER_MS = 1000; //Workers idle this long exit, last started first
+
+//Relaxed atomic post-increment of a counter shared between pool threads
+inline unsigned AtomicIncrement(unsigned& counter) {
+    return __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+}
+
+/* Producer of whole-nonce work, polled by idle threads */
+class NonceSource {
+      friend class Scheduler;
+      unsigned users;            //threads inside RunNext, under scheduler mutex
+public:
+      NonceSource() : users(0) {};
+      virtual ~NonceSource() {};
+      //Solves one nonce if the source has one to start, false otherwise
+      virtual bool RunNext() = 0;
+};
+
+class Scheduler {
+      struct Group;
+      struct Task {
+          const std::function<void(unsigned)>* fn;
+          unsigned index;
+          Group* group;
+          bool claimed;                 //counted in the active threads of group
+      };
+      struct Worker {
+          std::mutex mutex;
+          std::deque<Task> tasks;
+          unsigned node;                //NUMA node the thread is pinned to when placed
+          bool placed;                  //pinned by the thread itself
+          bool placing;                 //placement was on when last tried, pinned or not
+          Worker() : node(0), placed(false), placing(false) {};
+      };
+      std::mutex mutex;
+      std::condition_variable wake;     //new tasks, nonce capacity or finished groups
+      Worker* workers[MAX_WORKERS];
+      std::atomic<unsigned> workerCount;
+      std::vector<std::thread> threads;
+      Worker injected;                  //tasks from threads outside the scheduler
+      std::vector<NonceSource*> sources;
+      unsigned nextSource;
+      std::atomic<unsigned> queued;     //tasks waiting in deques
+      uint64_t epoch;                   //bumped by Notify, under mutex
+      std::atomic<bool> stopping;       //set when the process exits, the scheduler is never destroyed
+      std::atomic<unsigned> byNode;     //searches that want workers pinned to NUMA nodes
+      static thread_local Worker* current;  //worker run by this thread, if any
+      static thread_local Group* waiting;   //group of the innermost ParallelFor of this thread
+      Scheduler() : workerCount(0), nextSource(0), queued(0), epoch(0), stopping(false), byNode(0) {};
+      Scheduler(const Scheduler&);
+      Scheduler& operator=(const Scheduler&);
+      void WorkerLoop(Worker* self);
+      bool Claim(Task& task);
+      bool PopTask(Task& task);
+      bool Retire(Worker* self);
+      bool RunSource();
+      void Run(const Task& task);
+      void Place(Worker* self, bool on);
+public:
+      static Scheduler& Instance();
+      void Stop();                    //workers return instead of taking more work
+      void Reserve(unsigned count);   //start worker threads up to count, idle ones retire
+      //Workers are pinned to NUMA nodes from their next task on until every
+      //search that began placement has ended it
+      void BeginNodePlacement();
+      void EndNodePlacement();
+      //Runs task(i) for i in [0,count) on at most `threads` threads at once;
+      //the caller works and steals until every index has run
+      void ParallelFor(unsigned count, unsigned threads, const std::function<void(unsigned)>& task);
+      //Runs one stolen task, and if allowed one nonce, false if there was none
+      bool RunOne(bool allowNonces);
+      void WaitForWork(uint64_t seenEpoch);
+      uint64_t Epoch();
+      void Notify();                  //wake idle threads to poll the sources again
+      void AddSource(NonceSource* source);
+      void RemoveSource(NonceSource* source); //waits until no thread is inside it
+};
+
+#endif //define __SCHEDULER
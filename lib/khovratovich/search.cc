@@ -0,0 +1,201 @@
+/* Proof search that solves several nonces at the same time. */
+
+#include "search.h"
+#include "numa.h"
+#include "pool.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+
+//Node for the tables of a nonce started by the calling thread: its own with
+//NUMA placement on a host with several nodes, none otherwise
+static unsigned TableNode(const SolverOptions& options) {
+    return options.numa && NumaNodes() > 1 ? CurrentNode() : ANY_NODE;
+}
+
+/* Nonces of one search, solved by any scheduler thread */
+class NonceSearch : public NonceSource {
+    struct Solution {
+        Nonce nonce;
+        std::vector<Input> inputs;
+        bool operator<(const Solution& other) const { return nonce < other.nonce; }
+    };
+
+    const unsigned n;
+    const unsigned k;
+    const Seed seed;
+    const SolverOptions options;
+    const unsigned maxInFlight;
+    const unsigned wanted;
+    SearchControl control;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Equihash>> idle; //leased solvers between nonces
+    uint32_t nextNonce;
+    unsigned inFlight;
+    std::vector<Solution> found;  //kept in nonce order
+    DropCounts drops;
+    TableMemory memory;
+    SolveStats stats;
+
+    bool CanStart() const {
+        return nextNonce <= (uint32_t)MAX_NONCE && !control.Abandon(nextNonce) &&
+            (options.cancel == nullptr || !options.cancel->Stopped());
+    }
+public:
+    NonceSearch(unsigned n_in, unsigned k_in, const Seed& s, const SolverOptions& o, unsigned cap)
+        : n(n_in), k(k_in), seed(s), options(o), maxInFlight(cap),
+          wanted(std::max(o.maxSolutions, 1U)), control(o.firstWins), nextNonce(2), inFlight(0) {};
+    ~NonceSearch() {
+        for (unsigned i = 0; i < idle.size(); ++i) {
+            idle[i]->SetControl(nullptr);
+            SolverPool::Release(std::move(idle[i]));
+        }
+    }
+    bool RunNext();
+    bool Done() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return inFlight == 0 && !CanStart();
+    }
+    const DropCounts& Drops() const { return drops; }
+    const TableMemory& Memory() const { return memory; }
+    SolveStats Stats() const { //once done, when every solver is idle
+        SolveStats total = stats;
+        total.peakBytes = 0;
+        for (unsigned i = 0; i < idle.size(); ++i)
+            total.peakBytes += idle[i]->TableBytes();
+        return total;
+    }
+    std::vector<Proof> Result() const {
+        std::vector<Proof> proofs;
+        for (unsigned i = 0; i < found.size() && i < wanted; ++i)
+            proofs.push_back(Proof(n, k, seed, found[i].nonce, found[i].inputs));
+        return proofs;
+    }
+};
+
+bool NonceSearch::RunNext() {
+    std::unique_ptr<Equihash> solver;
+    Nonce nonce;
+    //with NUMA placement the tables of a nonce live on the node running it
+    const unsigned node = TableNode(options);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (inFlight >= maxInFlight || !CanStart())
+            return false;
+        nonce = nextNonce++;
+        inFlight++;
+        if (!idle.empty()) {
+            //a solver of another node is rebound rather than a new one taken,
+            //so the search never holds more than maxInFlight of them
+            size_t pick = idle.size() - 1;
+            for (size_t i = 0; i < idle.size(); ++i) {
+                if (idle[i]->Node() == node)
+                    pick = i;
+            }
+            solver = std::move(idle[pick]);
+            idle.erase(idle.begin() + pick);
+            solver->SetNode(node);
+        }
+    }
+    if (!solver) {
+        solver = SolverPool::Acquire(n, k, seed, node);
+        solver->SetOptions(options);
+        solver->SetControl(&control);
+        solver->ResetDrops();
+        solver->ResetStats();
+    }
+    std::vector<Input> inputs;
+    const bool solved = solver->SolveNonce(nonce, inputs);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (solved && nonce < control.bestNonce) {
+            //solutions of one nonce stay together and in their own order
+            const std::vector<Proof>& solutions = solver->Solutions();
+            std::vector<Solution>::iterator at =
+                std::upper_bound(found.begin(), found.end(), Solution{nonce, {}});
+            for (unsigned i = 0; i < solutions.size(); ++i)
+                at = found.insert(at, Solution{nonce, solutions[i].inputs}) + 1;
+            if (found.size() >= wanted)
+                control.bestNonce = found[wanted - 1].nonce;
+        }
+        drops += solver->Drops();
+        solver->ResetDrops();
+        memory += solver->Memory();
+        stats += solver->Stats();
+        solver->ResetStats();
+        inFlight--;
+        idle.push_back(std::move(solver));
+    }
+    Scheduler::Instance().Notify();
+    return true;
+}
+
+Proof SearchProof(unsigned n, unsigned k, const Seed& seed, const SolverOptions& options,
+                  DropCounts& drops) {
+    SolverOptions single = options;
+    single.maxSolutions = 1;
+    TableMemory memory;
+    SolveStats stats;
+    std::vector<Proof> proofs = SearchProofs(n, k, seed, single, drops, memory, stats);
+    if (proofs.empty())
+        return Proof(n, k, seed, MAX_NONCE, std::vector<Input>());
+    return proofs[0];
+}
+
+/* Worker threads pinned to NUMA nodes for the lifetime of a search */
+class NodePlacement {
+    const bool on;
+public:
+    NodePlacement(bool o) : on(o) {
+        if (on)
+            Scheduler::Instance().BeginNodePlacement();
+    }
+    ~NodePlacement() {
+        if (on)
+            Scheduler::Instance().EndNodePlacement();
+    }
+};
+
+std::vector<Proof> SearchProofs(unsigned n, unsigned k, const Seed& seed,
+                                const SolverOptions& options, DropCounts& drops,
+                                TableMemory& memory, SolveStats& stats) {
+    NodePlacement placement(options.numa);
+    unsigned inFlight = std::max(options.parallelNonces, 1U);
+    if (options.memoryLimit != 0) {
+        const size_t fits = options.memoryLimit / Equihash::MemoryFootprint(n, k, options);
+        inFlight = (unsigned)std::max<size_t>(std::min<size_t>(inFlight, fits), 1);
+    }
+    if (inFlight == 1) {
+        SolverLease solver(n, k, seed, TableNode(options));
+        solver->SetOptions(options);
+        solver->ResetDrops();
+        solver->ResetStats();
+        std::vector<Proof> proofs = solver->FindProofs(std::max(options.maxSolutions, 1U));
+        drops = solver->Drops();
+        memory = solver->Memory();
+        stats = solver->Stats();
+        return proofs;
+    }
+
+    //the caller is one of the threads; it starts nonces of its own search
+    //and helps with any queued task, but only sleeps when there is neither
+    NonceSearch search(n, k, seed, options, inFlight);
+    Scheduler& scheduler = Scheduler::Instance();
+    scheduler.Reserve(inFlight * std::max(options.threads, 1U) - 1);
+    scheduler.AddSource(&search);
+    while (!search.Done()) {
+        const uint64_t seen = scheduler.Epoch();
+        if (search.RunNext() || scheduler.RunOne(false))
+            continue;
+        if (search.Done())
+            break;
+        scheduler.WaitForWork(seen);
+    }
+    scheduler.RemoveSource(&search);
+    drops = search.Drops();
+    memory = search.Memory();
+    stats = search.Stats();
+    return search.Result();
+}
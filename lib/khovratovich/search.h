@@ -0,0 +1,32 @@
+/* Proof search that solves several nonces at the same time.
+
+   Nonces are handed out in increasing order to whichever scheduler thread
+   asks for one, and at most parallelNonces of them (fewer if memoryLimit
+   does not fit that many solvers) are in flight at once. Idle threads help
+   with the rounds of a nonce in flight before they start another one. By
+   default the proof of the lowest nonce wins, so the result is the same as
+   the serial search; nonces above the best one found so far are given up.
+   With firstWins the first proof found stops the search.
+
+   With maxSolutions above one every solution of a nonce is kept, and the
+   search goes on until that many are found; nonces above the last one
+   needed for them are given up.
+*/
+
+#ifndef __SEARCH
+#define __SEARCH
+
+#include "pow.h"
+
+//drops receives the entries lost over all nonces tried
+Proof SearchProof(unsigned n, unsigned k, const Seed& seed, const SolverOptions& options,
+                  DropCounts& drops);
+
+//up to options.maxSolutions proofs in nonce order, empty if none was found;
+//memory receives the backing of the tables of every solver used, and stats
+//the work of all of them
+std::vector<Proof> SearchProofs(unsigned n, unsigned k, const Seed& seed,
+                                const SolverOptions& options, DropCounts& drops,
+                                TableMemory& memory, SolveStats& stats);
+
+#endif //define __SEARCH
@@ -0,0 +1,24 @@
+/* Verification of many proofs in one call. */
+
+#include "verify.h"
+#include "cache.h"
+#include "scheduler.h"
+
+#include <algorithm>
+
+void VerifyProofs(unsigned n, unsigned k, size_t count,
+                  const uint32_t* seeds, unsigned seedWords, const Nonce* nonces,
+                  const Input* values, unsigned valueWords, unsigned threads,
+                  uint8_t* results) {
+    const size_t groups = (count + VERIFY_GROUP - 1) / VERIFY_GROUP;
+    Scheduler::Instance().ParallelFor((unsigned)groups, std::max(threads, 1U), [&](unsigned group) {
+        const size_t begin = (size_t)group * VERIFY_GROUP;
+        const size_t end = std::min<size_t>(begin + VERIFY_GROUP, count);
+        std::fill(results + begin / 8, results + (end + 7) / 8, 0);
+        for (size_t i = begin; i < end; ++i) {
+            const Seed seed(seeds + i * seedWords, seedWords);
+            if (VerifyCache::Test(n, k, seed, nonces[i], values + i * valueWords, valueWords))
+                results[i / 8] |= 1 << (i % 8);
+        }
+    });
+}
@@ -0,0 +1,26 @@
+/* Verification of many proofs in one call.
+
+   The proofs share n and k and are packed back to back: seeds, nonces and
+   solution values each have a fixed number of words per proof. Groups of
+   proofs are checked by the scheduler's threads, the caller among them, and
+   every group writes whole bytes of the result bitmap. Each proof goes
+   through the verification cache.
+*/
+
+#ifndef __VERIFY
+#define __VERIFY
+
+#include "pow.h"
+
+#include <cstddef>
+
+const unsigned VERIFY_GROUP = 64; //Proofs per work item, a multiple of 8
+
+//bit i of results (byte i/8, low bit first) is set if proof i is valid;
+//results holds (count + 7) / 8 bytes
+void VerifyProofs(unsigned n, unsigned k, size_t count,
+                  const uint32_t* seeds, unsigned seedWords, const Nonce* nonces,
+                  const Input* values, unsigned valueWords, unsigned threads,
+                  uint8_t* results);
+
+#endif //define __VERIFY
@@ -0,0 +1,158 @@
+/* Sort-based Equihash solver. */
+
+#include "radix.h"
+#include "../khovratovich/blake/blake2.h"
+
+#include <algorithm>
+
+void RadixEquihash::Fill() {
+    const unsigned bits = n / (k + 1);
+    const uint32_t length = 4UL << (bits - 1);
+    stride = k + 2; //all blocks and the index
+    records.resize((size_t)length * stride);
+
+    uint32_t prefix[SEED_LENGTH];
+    for (unsigned i = 0; i < SEED_LENGTH; ++i)
+        prefix[i] = seed[i];
+    blake2b_72_state state;
+    blake2b_72_init(&state, prefix);
+    uint64_t tails[HASH_BATCH];
+    uint32_t hash[HASH_BATCH][MAX_N / 4];
+    for (uint32_t first = 0; first < length; first += HASH_BATCH) {
+        const unsigned count = std::min<uint32_t>(HASH_BATCH, length - first);
+        for (unsigned b = 0; b < count; ++b)
+            tails[b] = nonce | (uint64_t)(first + b) << 32;
+        blake2b_72(&state, (uint8_t*)hash, tails, count);
+        for (unsigned b = 0; b < count; ++b) {
+            uint32_t* record = &records[(size_t)(first + b) * stride];
+            for (unsigned j = 0; j < k + 1; ++j)
+                record[j] = hash[b][j] >> (32 - bits);
+            record[k + 1] = first + b;
+        }
+    }
+}
+
+void RadixEquihash::Sort() {
+    //LSD radix sort of the record positions on the first block, then one
+    //gather so that runs of equal blocks are contiguous
+    const unsigned bits = n / (k + 1);
+    const size_t count = records.size() / stride;
+    keys.resize(count);
+    order.resize(count);
+    keysTmp.resize(count);
+    orderTmp.resize(count);
+    for (size_t r = 0; r < count; ++r) {
+        keys[r] = records[r * stride];
+        order[r] = r;
+    }
+    std::vector<uint32_t> buckets(1U << RADIX_BITS);
+    for (unsigned shift = 0; shift < bits; shift += RADIX_BITS) {
+        const uint32_t mask = (1U << RADIX_BITS) - 1;
+        std::fill(buckets.begin(), buckets.end(), 0);
+        for (size_t r = 0; r < count; ++r)
+            buckets[(keys[r] >> shift) & mask]++;
+        uint32_t sum = 0;
+        for (unsigned d = 0; d < buckets.size(); ++d) {
+            const uint32_t c = buckets[d];
+            buckets[d] = sum;
+            sum += c;
+        }
+        for (size_t r = 0; r < count; ++r) {
+            const uint32_t pos = buckets[(keys[r] >> shift) & mask]++;
+            keysTmp[pos] = keys[r];
+            orderTmp[pos] = order[r];
+        }
+        keys.swap(keysTmp);
+        order.swap(orderTmp);
+    }
+    sorted.resize(records.size());
+    for (size_t r = 0; r < count; ++r)
+        std::copy(&records[(size_t)order[r] * stride], &records[(size_t)order[r] * stride] + stride,
+                  &sorted[r * stride]);
+}
+
+void RadixEquihash::Collide(unsigned round) {
+    //Records of this round hold blocks round-1..k; a pair of records with the
+    //same first block makes a record of the remaining blocks XORed, except in
+    //the last round, where a pair whose last blocks are equal too is a
+    //candidate solution
+    const size_t count = sorted.size() / stride;
+    const unsigned blocks = stride - 1;
+    const bool last = round == k;
+    const size_t maxRecords = (size_t)RADIX_RECORD_FACTOR << (n / (k + 1));
+    if (forks.size() < round)
+        forks.resize(round);
+    std::vector<Fork>& newForks = forks[round - 1];
+    newForks.clear();
+    records.clear();
+    for (size_t begin = 0, end; begin < count; begin = end) {
+        const uint32_t* first = &sorted[begin * stride];
+        for (end = begin + 1; end < count && sorted[end * stride] == first[0]; ++end);
+        for (size_t j = begin; j < end; ++j) {
+            const uint32_t* a = &sorted[j * stride];
+            for (size_t m = j + 1; m < end; ++m) {
+                const uint32_t* b = &sorted[m * stride];
+                if (last) {
+                    if (a[1] == b[1])
+                        candidates.push_back(Fork(a[blocks], b[blocks]));
+                    continue;
+                }
+                //all remaining blocks equal: the pair can only lead to a
+                //solution that repeats its inputs, and such records pile
+                //up in one run that grows quadratically
+                unsigned l = 1;
+                while (l < blocks && a[l] == b[l])
+                    ++l;
+                if (l == blocks)
+                    continue;
+                if (newForks.size() >= maxRecords) {
+                    dropped++;
+                    continue;
+                }
+                for (l = 1; l < blocks; ++l)
+                    records.push_back(a[l] ^ b[l]);
+                records.push_back(newForks.size());
+                newForks.push_back(Fork(a[blocks], b[blocks]));
+            }
+        }
+    }
+    stride--;
+}
+
+std::vector<Input> RadixEquihash::ResolveTree(Fork fork, unsigned level) {
+    if (level == 0)
+        return std::vector<Input>{fork.ref1, fork.ref2};
+    auto v1 = ResolveTree(forks[level - 1][fork.ref1], level - 1);
+    auto v2 = ResolveTree(forks[level - 1][fork.ref2], level - 1);
+    v1.insert(v1.end(), v2.begin(), v2.end());
+    return v1;
+}
+
+bool RadixEquihash::SolveNonce(Nonce nonce_in, std::vector<Input>& inputs) {
+    nonce = nonce_in;
+    candidates.clear();
+    Fill();
+    for (unsigned round = 1; round <= k; ++round) {
+        Sort();
+        Collide(round);
+    }
+    for (unsigned c = 0; c < candidates.size(); ++c) {
+        std::vector<Input> solution = ResolveTree(candidates[c], k - 1);
+        std::vector<Input> check = solution;
+        std::sort(check.begin(), check.end());
+        if (std::adjacent_find(check.begin(), check.end()) == check.end()) {
+            inputs = solution;
+            return true;
+        }
+    }
+    return false;
+}
+
+Proof RadixEquihash::FindProof() {
+    std::vector<Input> inputs;
+    for (nonce = 2; nonce <= (Nonce)MAX_NONCE; ++nonce) {
+        if (SolveNonce(nonce, inputs))
+            return Proof(n, k, seed, nonce, inputs);
+    }
+    return Proof(n, k, seed, MAX_NONCE, std::vector<Input>());
+}
@@ -0,0 +1,45 @@
+/* Sort-based Equihash solver.
+
+   Instead of a hash table with fixed-size rows, every round keeps a flat list
+   of records (the blocks not collided yet, then a reference), radix-sorts it
+   on the block collided in that round and pairs up every run of equal values.
+   No entry is lost to a full row; the list is only capped at
+   RADIX_RECORD_FACTOR times the table size of the bucket engine. Proofs use
+   the same hash, nonce order and input order as the khovratovich engine and
+   are checked with the same Proof::Test.
+*/
+
+#ifndef __RADIX
+#define __RADIX
+
+#include "../khovratovich/pow.h"
+
+const unsigned RADIX_BITS = 11;         //Digit width of one radix sort pass
+const unsigned RADIX_RECORD_FACTOR = 4; //Records kept per round, in units of 2^(n/(k+1))
+
+class RadixEquihash {
+      std::vector<uint32_t> records;   //records of the current round
+      std::vector<uint32_t> sorted;    //the same records ordered by their first block
+      std::vector<uint32_t> keys, keysTmp;
+      std::vector<uint32_t> order, orderTmp;
+      std::vector<std::vector<Fork>> forks; //pairs of references made by every round
+      std::vector<Fork> candidates;    //zero collisions of the last round
+      unsigned n;
+      unsigned k;
+      Seed seed;
+      Nonce nonce;
+      unsigned stride;                 //words per record
+      uint64_t dropped;                //records over the cap, since construction
+      void Fill();
+      void Sort();
+      void Collide(unsigned round);
+      std::vector<Input> ResolveTree(Fork fork, unsigned level);
+public:
+      RadixEquihash(unsigned n_in, unsigned k_in, const Seed& s)
+          : n(n_in), k(k_in), seed(s), nonce(0), stride(0), dropped(0) {};
+      bool SolveNonce(Nonce nonce_in, std::vector<Input>& inputs); //false if no proof
+      Proof FindProof();
+      uint64_t Dropped() const { return dropped; }
+};
+
+#endif //define __RADIX
@@ -2,14 +2,58 @@ const assert = require('assert');
 const crypto = require('crypto');
 const equihash = require('..')('khovratovich');
 
+const helloWorld =
+  crypto.createHash('sha256').update('hello world', 'utf8').digest();
+// the n=90, k=5 proof of helloWorld, found at nonce 4 whatever the options
+const helloWorldProof = '+QMAADAHAADgFAAAoP0AAKgpAAAYQQAAiQ0AALgSAAAkKwAATXcAABVPAADecwAAkC0AADSkAAAFDgAAfiMAAA8HAAAdzAAAclYAAAt5AAAynwAABOYAAGsVAAANiwAAKF0AAJuLAADAGwAAy5cAAOQIAAByGwAAesQAAKDnAAA=';
+
+// solves helloWorld at n=90, k=5 with options and checks it gives
+// helloWorldProof; check, if given, gets the proof for further asserts
+const solveGolden = (options, done, check) => {
+  equihash.solve(helloWorld, Object.assign({n: 90, k: 5}, options),
+    (err, proof) => {
+      assert.ifError(err);
+      assert.equal(proof.nonce, 4);
+      const b64proof = Buffer.from(proof.value).toString('base64');
+      assert.equal(b64proof, helloWorldProof);
+      if(check) {
+        check(proof);
+      }
+      done();
+    });
+};
+
+// AbortController is only global from Node.js 15 on
+const abortController = () => {
+  if(typeof AbortController === 'function') {
+    return new AbortController();
+  }
+  const listeners = [];
+  const signal = {
+    aborted: false,
+    addEventListener: (type, listener) => listeners.push(listener),
+    removeEventListener: (type, listener) => {
+      if(listeners.indexOf(listener) !== -1) {
+        listeners.splice(listeners.indexOf(listener), 1);
+      }
+    }
+  };
+  return {
+    signal,
+    abort: () => {
+      signal.aborted = true;
+      listeners.slice().forEach(listener => listener());
+    }
+  };
+};
+
 describe('Equihash', function() {
   it('should generate a proof', function(done) {
     const options = {
       n: 90,
       k: 5
     };
-    const input =
-      crypto.createHash('sha256').update('hello world', 'utf8').digest();
+    const input = helloWorld;
 
     equihash.solve(input, options, (err, proof) => {
       assert.ifError(err);
@@ -18,7 +62,7 @@ describe('Equihash', function() {
       assert(proof.nonce);
       assert(proof.value);
       const b64proof = Buffer.from(proof.value).toString('base64');
-      assert.equal(b64proof, '+QMAADAHAADgFAAAoP0AAKgpAAAYQQAAiQ0AALgSAAAkKwAATXcAABVPAADecwAAkC0AADSkAAAFDgAAfiMAAA8HAAAdzAAAclYAAAt5AAAynwAABOYAAGsVAAANiwAAKF0AAJuLAADAGwAAy5cAAOQIAAByGwAAesQAAKDnAAA=');
+      assert.equal(b64proof, helloWorldProof);
       done();
     });
   });
@@ -54,13 +98,216 @@ describe('Equihash', function() {
       done();
     });
   });
+  it('should generate the same proof with several threads', function(done) {
+    solveGolden({threads: 4}, done);
+  });
+  it('should generate a valid proof with blocks wider than 16 bits', function(done) {
+    // n/(k+1) = 17 keeps one block per word, unlike the 15 bits of 90/5
+    const options = {
+      n: 102,
+      k: 5
+    };
+    const input = helloWorld;
+
+    equihash.solve(input, options, (err, proof) => {
+      assert.ifError(err);
+      assert.equal(proof.nonce, 4);
+      assert(equihash.verify(input, proof));
+      options.threads = 2;
+      equihash.solve(input, options, (err, threaded) => {
+        assert.ifError(err);
+        assert.equal(threaded.nonce, proof.nonce);
+        assert.deepEqual(threaded.value, proof.value);
+        done();
+      });
+    });
+  });
+  it('should generate the same proof with parallel nonces', function(done) {
+    solveGolden({parallelNonces: 3}, done);
+  });
+  it('should generate the same proof under a memory limit', function(done) {
+    solveGolden({threads: 2, parallelNonces: 3, memoryLimit: 1}, done);
+  });
+  it('should generate the same proof with truncated references', function(done) {
+    solveGolden({threads: 2, truncateBits: 7}, done);
+  });
+  it('should generate the same proof in huge-page tables', function(done) {
+    solveGolden({hugePages: true, lockMemory: true}, done, proof => {
+      assert(['hugetlb', 'transparent', 'default']
+        .indexOf(proof.memory.backing) !== -1);
+      assert.equal(typeof proof.memory.locked, 'boolean');
+    });
+  });
+  it('should generate the same proof with NUMA placement', function(done) {
+    solveGolden({threads: 2, parallelNonces: 2, numa: true}, done, proof => {
+      assert.equal(typeof proof.memory.bound, 'boolean');
+    });
+  });
+  it('should stop a solve that passes its deadline', function(done) {
+    const options = {
+      n: 90,
+      k: 5,
+      maxSolutions: 1000,
+      deadlineMs: 50
+    };
+    const input = helloWorld;
+
+    equihash.solve(input, options, (err, proof) => {
+      assert(err);
+      assert.equal(err.name, 'TimeoutError');
+      assert(!proof);
+      done();
+    });
+  });
+  it('should stop a solve when its signal aborts', function(done) {
+    const controller = abortController();
+    const options = {
+      n: 90,
+      k: 5,
+      maxSolutions: 1000,
+      signal: controller.signal
+    };
+    const input = helloWorld;
+
+    equihash.solve(input, options, (err, proof) => {
+      assert(err);
+      assert.equal(err.name, 'AbortError');
+      assert(!proof);
+      equihash.solve(input, options, err => {
+        assert.equal(err.name, 'AbortError');
+        done();
+      });
+    });
+    setTimeout(() => controller.abort(), 50);
+  });
+  it('should return statistics of the solve', function(done) {
+    const options = {
+      n: 90,
+      k: 5,
+      stats: true
+    };
+    const input = helloWorld;
+
+    equihash.solve(input, options, (err, proof) => {
+      assert.ifError(err);
+      assert.equal(proof.nonce, 4);
+      const stats = proof.stats;
+      assert.equal(stats.nonces, 3);
+      assert.equal(stats.rounds.length, options.k);
+      assert(stats.fill.time > 0);
+      stats.rounds.forEach(round => assert(round.time > 0));
+      assert.deepEqual(stats.dropped, proof.dropped);
+      // 25 whose two halves share a subtree and 24 that repeat an input
+      // deeper in their tree
+      assert.equal(stats.duplicates, 49);
+      assert(stats.peakBytes > 0);
+      done();
+    });
+  });
+  it('should count the same duplicates with several threads', function(done) {
+    solveGolden({threads: 4, stats: true}, done, proof => {
+      assert.equal(proof.stats.duplicates, 49);
+    });
+  });
+  it('should return every solution found up to maxSolutions', function(done) {
+    const options = {
+      n: 90,
+      k: 5,
+      maxSolutions: 3
+    };
+    const input = helloWorld;
+
+    equihash.solve(input, options, (err, proof) => {
+      assert.ifError(err);
+      const solutions = proof.solutions;
+      assert.equal(solutions.nonces.length, 3);
+      assert.equal(solutions.offsets.length, 4);
+      assert.equal(solutions.offsets[3], solutions.value.length);
+      assert.equal(solutions.nonces[0], proof.nonce);
+      assert.deepEqual(
+        solutions.value.slice(solutions.offsets[0], solutions.offsets[1]),
+        proof.value);
+      for(let i = 0; i < 3; ++i) {
+        if(i > 0) {
+          assert(solutions.nonces[i] >= solutions.nonces[i - 1]);
+        }
+        assert(equihash.verify(input, {
+          n: 90,
+          k: 5,
+          nonce: solutions.nonces[i],
+          value: solutions.value.slice(
+            solutions.offsets[i], solutions.offsets[i + 1])
+        }));
+      }
+      options.threads = 2;
+      options.parallelNonces = 3;
+      equihash.solve(input, options, (err, parallel) => {
+        assert.ifError(err);
+        assert.deepEqual(parallel.solutions.nonces, solutions.nonces);
+        assert.deepEqual(parallel.solutions.value, solutions.value);
+        done();
+      });
+    });
+  });
+  it('should generate a valid proof when the first proof wins', function(done) {
+    const options = {
+      n: 90,
+      k: 5,
+      parallelNonces: 3,
+      firstWins: true
+    };
+    const input = helloWorld;
+
+    equihash.solve(input, options, (err, proof) => {
+      assert.ifError(err);
+      assert(proof.nonce);
+      assert(equihash.verify(input, proof));
+      done();
+    });
+  });
+  it('should generate the same proof after a warmup', function(done) {
+    equihash.warmup({n: 90, k: 5, count: 2}, err => {
+      assert.ifError(err);
+      solveGolden({}, done);
+    });
+  });
+  it('should release the solvers kept warm', function(done) {
+    equihash.warmup({n: 90, k: 5}, err => {
+      assert.ifError(err);
+      assert(equihash.releaseSolvers() > 0);
+      assert.equal(equihash.releaseSolvers(), 0);
+      done();
+    });
+  });
+  it('should drop fewer tuples with a spill area', function(done) {
+    const input = helloWorld;
+
+    equihash.solve(input, {n: 90, k: 5}, (err, plain) => {
+      assert.ifError(err);
+      equihash.solve(input, {n: 90, k: 5, spill: true}, (err, proof) => {
+        assert.ifError(err);
+        assert(equihash.verify(input, proof));
+        // nonces are tried from 2 on
+        const perNonce = p => p.dropped.tuples / (p.nonce - 1);
+        assert(perNonce(proof) < perNonce(plain));
+        done();
+      });
+    });
+  });
+  it('should report the selected instruction set', function() {
+    assert(['avx512f', 'avx2', 'sse2', 'generic'].indexOf(equihash.isa) !== -1);
+  });
+  it('should list the parameter sets with compiled kernels', function() {
+    assert.deepEqual(equihash.presets, [
+      {n: 90, k: 5}, {n: 96, k: 5}, {n: 144, k: 5}
+    ]);
+  });
   it('should verify a valid proof', function(done) {
     const options = {
       n: 90,
       k: 5
     };
-    const input =
-      crypto.createHash('sha256').update('hello world', 'utf8').digest();
+    const input = helloWorld;
 
     equihash.solve(input, options, (err, proof) => {
       assert.ifError(err);
@@ -73,13 +320,90 @@ describe('Equihash', function() {
       done();
     });
   });
+  it('should verify a proof asynchronously', function(done) {
+    const options = {
+      n: 90,
+      k: 5
+    };
+    const input = helloWorld;
+
+    equihash.solve(input, options, (err, proof) => {
+      assert.ifError(err);
+      equihash.verifyAsync(input, proof, (err, valid) => {
+        assert.ifError(err);
+        assert.strictEqual(valid, true);
+        const inputAlternate = crypto.createHash('sha256')
+          .update('goodbye cruel world', 'utf8').digest();
+        equihash.verifyAsync(inputAlternate, proof).then(valid => {
+          assert.strictEqual(valid, equihash.verify(inputAlternate, proof));
+          assert.strictEqual(valid, false);
+          done();
+        }).catch(done);
+      });
+    });
+  });
+  it('should answer repeated verifications from the cache', function(done) {
+    const options = {
+      n: 90,
+      k: 5
+    };
+    const input = helloWorld;
+
+    equihash.solve(input, options, (err, proof) => {
+      assert.ifError(err);
+      equihash.configureVerifyCache({size: 16});
+      assert(equihash.verify(input, proof));
+      assert(equihash.verify(input, proof));
+      const changed = Buffer.from(proof.value);
+      changed[0] ^= 1;
+      const invalid = {n: 90, k: 5, nonce: proof.nonce, value: changed};
+      assert(!equihash.verify(input, invalid));
+      assert(!equihash.verify(input, invalid));
+      assert.deepEqual(
+        equihash.verifyCacheStats(), {hits: 2, misses: 2, size: 2});
+      equihash.configureVerifyCache({size: 0});
+      assert(equihash.verify(input, proof));
+      assert.deepEqual(
+        equihash.verifyCacheStats(), {hits: 0, misses: 0, size: 0});
+      done();
+    });
+  });
+  it('should verify a batch of proofs', function(done) {
+    const options = {
+      n: 90,
+      k: 5,
+      maxSolutions: 3
+    };
+    const input = helloWorld;
+
+    equihash.solve(input, options, (err, proof) => {
+      assert.ifError(err);
+      const solutions = proof.solutions;
+      const nonces = Buffer.alloc(16);
+      solutions.nonces.forEach((nonce, i) => nonces.writeUInt32LE(nonce, i * 4));
+      // the last proof is the first one with a changed input
+      nonces.writeUInt32LE(solutions.nonces[0], 12);
+      const changed = Buffer.from(proof.value);
+      changed[0] ^= 1;
+      const values = Buffer.concat([solutions.value, changed]);
+      const results = equihash.verifyBatch({
+        n: 90,
+        k: 5,
+        seeds: Buffer.concat([input, input, input, input]),
+        nonces,
+        values,
+        threads: 2
+      });
+      assert.deepEqual(results, Buffer.from([0x07]));
+      done();
+    });
+  });
   it('should fail to verify a proof with input < k', function(done) {
     const options = {
       n: 90,
       k: 5
     };
-    const input =
-      crypto.createHash('sha256').update('hello world', 'utf8').digest();
+    const input = helloWorld;
 
     equihash.solve(input, options, (err, proof) => {
       assert.ifError(err);
@@ -101,8 +425,7 @@ describe('Equihash', function() {
       n: 90,
       k: 5
     };
-    const input =
-      crypto.createHash('sha256').update('hello world', 'utf8').digest();
+    const input = helloWorld;
 
     equihash.solve(input, options, (err, proof) => {
       assert.ifError(err);
@@ -121,8 +444,7 @@ describe('Equihash', function() {
       n: 90,
       k: 5
     };
-    const input =
-      crypto.createHash('sha256').update('hello world', 'utf8').digest();
+    const input = helloWorld;
 
     equihash.solve(input, options, (err, proof) => {
       assert.ifError(err);
@@ -135,4 +457,65 @@ describe('Equihash', function() {
       done();
     });
   });
+  it('should fail to verify a proof that is not a collision tree', function(done) {
+    const options = {
+      n: 90,
+      k: 5
+    };
+    const input = helloWorld;
+
+    equihash.solve(input, options, (err, proof) => {
+      assert.ifError(err);
+      // the same inputs with the first and third swapped still xor to zero
+      const swapped = Buffer.from(proof.value);
+      proof.value.copy(swapped, 0, 8, 12);
+      proof.value.copy(swapped, 8, 0, 4);
+      assert(!equihash.verify(input, {n: 90, k: 5, nonce: proof.nonce, value: swapped}));
+      // a repeated input, and one input too many
+      const repeated = Buffer.from(proof.value);
+      proof.value.copy(repeated, 4, 0, 4);
+      assert(!equihash.verify(input, {n: 90, k: 5, nonce: proof.nonce, value: repeated}));
+      const longer = Buffer.concat([proof.value, proof.value.slice(0, 4)]);
+      assert(!equihash.verify(input, {n: 90, k: 5, nonce: proof.nonce, value: longer}));
+      done();
+    });
+  });
+});
+
+describe('Equihash radix engine', function() {
+  const radix = require('..')('radix');
+
+  it('should generate a proof that both engines verify', function(done) {
+    const options = {
+      n: 90,
+      k: 5
+    };
+    const input = helloWorld;
+
+    radix.solve(input, options, (err, proof) => {
+      assert.ifError(err);
+      assert.equal(proof.n, options.n);
+      assert.equal(proof.k, options.k);
+      assert(proof.nonce);
+      assert(proof.value);
+      assert(radix.verify(input, proof));
+      assert(equihash.verify(input, proof));
+      done();
+    });
+  });
+  it('should verify a proof of the default engine', function(done) {
+    const options = {
+      n: 90,
+      k: 5
+    };
+    const input = helloWorld;
+
+    equihash.solve(input, options, (err, proof) => {
+      assert.ifError(err);
+      assert(radix.verify(input, proof));
+      proof.value[0] = 0;
+      assert(!radix.verify(input, proof));
+      done();
+    });
+  });
 });